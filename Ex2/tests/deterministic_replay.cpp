@@ -0,0 +1,126 @@
+/**********************************************
+ * Test: deterministic mode replays the same interleaving
+ *
+ * steps:
+ * a child process runs NUM_THREADS threads in deterministic mode with a seed,
+ * every thread appends its id to a trace at each preemption point.
+ * the child sends the trace and the recorded schedule to the parent.
+ * a second child replays the schedule, and a third one uses the seed again,
+ * both traces should be identical to the first one.
+ *
+ **********************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../uthreads.h"
+
+#define GRN "\e[32m"
+#define RED "\x1B[31m"
+#define RESET "\x1B[0m"
+
+#define NUM_THREADS 4
+#define ITERATIONS 200
+#define SEED 2021
+#define QUANTUM_POINTS 7
+#define MAX_SCHEDULE 4096
+
+char trace[NUM_THREADS * ITERATIONS + 1];
+int traceLength = 0;
+int finished = 0;
+
+void thread()
+{
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        trace[traceLength++] = (char) ('0' + uthread_get_tid());
+        uthread_preemption_point();
+    }
+    ++finished;
+    while (true)
+    {
+        uthread_preemption_point();
+    }
+}
+
+struct Run
+{
+    char trace[NUM_THREADS * ITERATIONS + 1];
+    int scheduleLength;
+    long schedule[MAX_SCHEDULE];
+};
+
+// runs the threads in a child process, and returns its trace and schedule
+void run(const Run* replay, Run* result)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        exit(1);
+    }
+    if (fork() == 0)
+    {
+        if (replay == nullptr)
+        {
+            uthread_init_deterministic(SEED, QUANTUM_POINTS);
+        }
+        else
+        {
+            uthread_init_replay(replay->schedule, replay->scheduleLength);
+        }
+        for (int i = 1; i < NUM_THREADS; ++i)
+        {
+            uthread_spawn(thread);
+        }
+        for (int i = 0; i < ITERATIONS; ++i)
+        {
+            trace[traceLength++] = '0';
+            uthread_preemption_point();
+        }
+        while (finished < NUM_THREADS - 1)
+        {
+            uthread_preemption_point();
+        }
+
+        Run* out = new Run();
+        memcpy(out->trace, trace, sizeof(trace));
+        out->scheduleLength = uthread_get_schedule(out->schedule, MAX_SCHEDULE);
+        if (write(fds[1], out, sizeof(Run)) != sizeof(Run))
+        {
+            exit(1);
+        }
+        uthread_terminate(0);
+    }
+    close(fds[1]);
+    size_t got = 0;
+    ssize_t n;
+    while (got < sizeof(Run) && (n = read(fds[0], (char*) result + got, sizeof(Run) - got)) > 0)
+    {
+        got += n;
+    }
+    close(fds[0]);
+    wait(nullptr);
+    if (got != sizeof(Run))
+    {
+        printf(RED "ERROR - child failed\n" RESET);
+        exit(1);
+    }
+}
+
+int main()
+{
+    static Run recorded, replayed, reseeded;
+    run(nullptr, &recorded);
+    run(&recorded, &replayed);
+    run(nullptr, &reseeded);
+
+    if (strcmp(recorded.trace, replayed.trace) != 0 || strcmp(recorded.trace, reseeded.trace) != 0)
+    {
+        printf(RED "ERROR - interleaving was not reproduced\n" RESET);
+        exit(1);
+    }
+    printf(GRN "SUCCESS\n" RESET);
+    return 0;
+}
@@ -0,0 +1,77 @@
+/**********************************************
+ * Benchmark: uthread_spawn vs uthread_spawn_batch
+ *
+ * steps:
+ * spawn MAX_THREAD_NUM - 1 threads from main and terminate all of them,
+ * repeat until at least TOTAL_THREADS threads were started, once with
+ * uthread_spawn and once with uthread_spawn_batch, and print the time per
+ * thread started.
+ * the quantum is long enough so the spawned threads never run.
+ *
+ **********************************************/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "../uthreads.h"
+
+#define TOTAL_THREADS 10000
+#define BATCH (MAX_THREAD_NUM - 1)
+#define QUANTUM 999999
+
+void halt()
+{
+    while (true)
+    {}
+}
+
+double run(bool batched)
+{
+    void (*fns[BATCH])(void);
+    int tids[BATCH];
+    for (int i = 0; i < BATCH; ++i)
+    {
+        fns[i] = halt;
+    }
+
+    int spawned = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (; spawned < TOTAL_THREADS; spawned += BATCH)
+    {
+        if (batched)
+        {
+            if (uthread_spawn_batch(fns, BATCH, tids) != 0)
+            {
+                exit(1);
+            }
+        }
+        else
+        {
+            for (int i = 0; i < BATCH; ++i)
+            {
+                tids[i] = uthread_spawn(halt);
+                if (tids[i] == -1)
+                {
+                    exit(1);
+                }
+            }
+        }
+        for (int i = 0; i < BATCH; ++i)
+        {
+            uthread_terminate(tids[i]);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / spawned;
+}
+
+int main()
+{
+    uthread_init(QUANTUM);
+    double single = run(false);
+    double batched = run(true);
+    printf("uthread_spawn:       %8.1f ns/thread\n", single);
+    printf("uthread_spawn_batch: %8.1f ns/thread (x%.2f)\n", batched, single / batched);
+    uthread_terminate(0);
+    return 0;
+}
@@ -0,0 +1,114 @@
+/**********************************************
+ * Test: thread-specific data keys
+ *
+ * steps:
+ * main creates a key, and checks that bad keys are rejected.
+ * NUM_THREADS threads read NULL from the key, set it to their own value and
+ * check it at every preemption point, while the threads switch (deterministic
+ * mode), and main checks its own value is kept.
+ * a thread sets the key and terminates itself, the next spawned thread gets its
+ * tid and should read NULL.
+ *
+ **********************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include "../uthreads.h"
+
+#define GRN "\e[32m"
+#define RED "\x1B[31m"
+#define RESET "\x1B[0m"
+
+#define NUM_THREADS 3
+#define ITERATIONS 100
+#define SEED 26
+#define QUANTUM_POINTS 3
+
+uthread_key_t key;
+int values[MAX_THREAD_NUM];
+int finished = 0;
+
+void check(bool condition, const char* message)
+{
+    if (!condition)
+    {
+        printf(RED "ERROR - %s\n" RESET, message);
+        exit(1);
+    }
+}
+
+void thread()
+{
+    const int tid = uthread_get_tid();
+    check(uthread_getspecific(key) == nullptr, "a new thread did not read NULL");
+    check(uthread_setspecific(key, &values[tid]) == 0, "setspecific failed");
+    for (int i = 0; i < ITERATIONS; ++i)
+    {
+        check(uthread_getspecific(key) == &values[tid], "a value was not kept across a context switch");
+        uthread_preemption_point();
+    }
+    ++finished;
+    while (true)
+    {
+        uthread_preemption_point();
+    }
+}
+
+void terminatedThread()
+{
+    const int tid = uthread_get_tid();
+    uthread_setspecific(key, &values[tid]);
+    uthread_terminate(tid);
+}
+
+void reusingThread()
+{
+    check(uthread_getspecific(key) == nullptr, "a reused tid inherited the old value");
+    ++finished;
+    while (true)
+    {
+        uthread_preemption_point();
+    }
+}
+
+int main()
+{
+    uthread_init_deterministic(SEED, QUANTUM_POINTS);
+
+    check(uthread_key_create(&key) == 0, "key_create failed");
+    check(uthread_key_create(nullptr) == -1, "a NULL key was accepted");
+    check(uthread_setspecific(-1, &values[0]) == -1, "a negative key was accepted");
+    check(uthread_setspecific(key + 1, &values[0]) == -1, "a key which was not created was accepted");
+    check(uthread_setspecific(MAX_KEY_NUM, &values[0]) == -1, "a key out of range was accepted");
+    check(uthread_getspecific(-1) == nullptr, "a negative key has a value");
+    check(uthread_getspecific(key + 1) == nullptr, "a key which was not created has a value");
+    check(uthread_setspecific(key, &values[0]) == 0, "setspecific failed");
+
+    for (int i = 0; i < NUM_THREADS; ++i)
+    {
+        check(uthread_spawn(thread) > 0, "spawn failed");
+    }
+    while (finished < NUM_THREADS)
+    {
+        check(uthread_getspecific(key) == &values[0], "the value of main was not kept");
+        uthread_preemption_point();
+    }
+    check(uthread_get_total_quantums() > NUM_THREADS, "the threads did not switch");
+
+    const int tid = uthread_spawn(terminatedThread);
+    // the thread is gone once its quantums can not be read (an error is logged)
+    while (uthread_get_quantums(tid) != -1)
+    {
+        uthread_preemption_point();
+    }
+    check(uthread_spawn(reusingThread) == tid, "the tid was not reused");
+    while (finished < NUM_THREADS + 1)
+    {
+        uthread_preemption_point();
+    }
+    check(uthread_getspecific(key) == &values[0], "the value of main was not kept");
+
+    printf(GRN "SUCCESS\n" RESET);
+    uthread_terminate(0);
+    return 0;
+}
@@ -13,6 +13,10 @@
 #include <setjmp.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <new>
+#include <atomic>
+#include <unistd.h>
+#include <cstring>
 #include <algorithm>
 #include <vector>
 #include <queue>
@@ -68,18 +72,41 @@ address_t translate_address(address_t addr)
 #define MAIN_THREAD concurrentThreads[0]
 #define MAIN_TID 0
 #define NO_THREAD -1
+#define LOG_SIZE 4096
 
 // ------------------------------ GLOBAL VARIABLES -----------------------------------
 
+/* A block of threads spawned together by uthread_spawn_batch(). The Uthread
+ * objects and their stacks share one allocation, which is released when the
+ * last thread of the slab is terminated. */
+struct Slab {
+	char* memory;
+	int liveThreads;
+};
+
 class Uthread {
 public:
 	int tid;
 	int quanta = 0;
 	char* tStack;
+	Slab* slab = nullptr;	// nullptr if the thread owns its stack
 	sigjmp_buf env = {0};
+	void* specific[MAX_KEY_NUM]{nullptr};	// thread-specific data, indexed by key
 
 	explicit Uthread(int tid=MAIN_TID, void (*f)()=nullptr): tid(tid) {
 		tStack = new char[STACK_SIZE];
+		setupContext(f);
+	}
+
+	Uthread(int tid, void (*f)(), char* stack, Slab* slab)
+		: tid(tid), tStack(stack), slab(slab) {
+		setupContext(f);
+	}
+
+	~Uthread() { if (slab == nullptr) { delete[] tStack; } }
+
+private:
+	void setupContext(void (*f)()) {
 		address_t sp, pc;
 		sp = (address_t) tStack + STACK_SIZE - sizeof(address_t);
 		pc = (address_t) f;
@@ -88,10 +115,11 @@ public:
 		(env->__jmpbuf)[JB_PC] = translate_address(pc);
 		sigemptyset(&env->__saved_mask);
 	}
-
-	~Uthread() { delete[] tStack; }
 };
 
+// size of a Uthread and its stack inside a slab, keeps the stack 16 bytes aligned
+#define SLAB_STRIDE (((sizeof(Uthread) + 15) & ~(size_t) 15) + STACK_SIZE)
+
 struct Mutex {
 	bool isLocked;
 	int tid;
@@ -111,20 +139,60 @@ static sigset_t alarmSet;
 static struct sigaction sa;
 static struct itimerval timer;
 
-static struct sigaction ignore = {.sa_handler= SIG_IGN};
 static struct itimerval stopTimer = {0};
 
 static Mutex mutex{false, NO_THREAD};
 
+/* A thread which terminated itself still runs on its stack until it jumps to
+ * the next thread, so it is released only on the next self termination (or
+ * when the process terminates). */
+static Uthread* finishedThread = nullptr;
+
+/* Diagnostics are appended to a lock-free ring buffer instead of std::cerr,
+ * so logging is async-signal-safe and never blocks a context switch. They are
+ * written to stderr by flushLog(), which uses write() only, as soon as the
+ * message is logged outside the SIGVTALRM handler; messages logged inside it
+ * wait for the next flush. Messages that do not fit before the next flush are
+ * dropped (and counted). */
+static char logBuffer[LOG_SIZE];
+static std::atomic<size_t> logHead{0};		// bytes reserved by writers
+static std::atomic<size_t> logCommitted{0};	// bytes completely written
+static std::atomic<size_t> logTail{0};		// bytes already flushed
+static std::atomic<size_t> logDropped{0};
+static std::atomic_flag logFlushing = ATOMIC_FLAG_INIT;	// a thread is inside flushLog()
+static volatile sig_atomic_t inTimerHandler = 0;
+static bool flushAtExit = false;
+
+static int totalKeys;	// keys are allocated in order, so [0, totalKeys) are valid
+
+/* In the deterministic modes the timer is never armed (timer stays zero, so
+ * restarting it disarms it), and quanta end only at preemption points, as
+ * decided by a seeded PRNG or by a recorded schedule. */
+enum ScheduleMode {TIMER_MODE, RANDOM_MODE, REPLAY_MODE};
+
+static ScheduleMode scheduleMode = TIMER_MODE;
+static unsigned long long prngState;
+static int quantumPoints;
+static long totalPoints;
+static std::vector<long> recordedSwitches;	// preemption points where quanta ended
+static std::vector<long> replaySwitches;
+static size_t nextReplaySwitch;
+
 // ------------------------------ HELPER FUNCTIONS ----------------------------------
 
+void logError(const char* msg);
+void flushLog();
 void setQuantumTimer(int quantum_usecs);
 void timerHandler(int sig);
+void initLibrary();
+unsigned long long nextRandom();
+void preemptionPoint();
 int setThreadID();
 int getReadyThread();
 bool isReady(int tid);
 bool isBlocked(int tid);
 bool isWaiting(int tid);
+void releaseThread(Uthread* thread);
 void terminateProcess();
 
 // ----------------------------------------------------------------------------------
@@ -133,6 +201,93 @@ void terminateProcess();
  * I. disable timer		II. remove pending
  * III. set SIGVTALRM handler to be SIG_IGN */
 
+/**
+ * @brief appends msg and a new line to the log buffer, and flushes it unless
+ * 		  called from the SIGVTALRM handler. Safe to call from the handler, even
+ * 		  if it interrupted another logError().
+ */
+void logError(const char* msg) {
+	const size_t len = strlen(msg) + 1;
+	size_t head = logHead.load();
+	do {
+		if (head + len - logTail.load() > LOG_SIZE) {
+			++logDropped;
+			return;
+		}
+	} while (!logHead.compare_exchange_weak(head, head + len));
+	for (size_t i = 0; i < len; ++i) {
+		logBuffer[(head + i) % LOG_SIZE] = (i + 1 < len) ? msg[i] : '\n';
+	}
+	logCommitted += len;
+	if (!inTimerHandler) { flushLog(); }
+}
+
+/**
+ * @brief writes the buffered messages to stderr. Only completely written
+ * 		  messages are flushed, so it does nothing while a writer is interrupted,
+ * 		  or while another thread was switched out in the middle of a flush.
+ */
+void flushLog() {
+	if (logFlushing.test_and_set()) { return; }
+	const size_t committed = logCommitted.load();
+	if (committed != logHead.load()) {
+		logFlushing.clear();
+		return;
+	}
+	size_t tail = logTail.load();
+	while (tail < committed) {
+		const size_t begin = tail % LOG_SIZE;
+		const size_t chunk = std::min(committed - tail, LOG_SIZE - begin);
+		const ssize_t written = write(STDERR_FILENO, logBuffer + begin, chunk);
+		if (written <= 0) { break; }
+		tail += written;
+	}
+	logTail = tail;
+	const size_t dropped = logDropped.exchange(0);
+	if (dropped > 0) {
+		const char note[] = "thread library: log buffer full, messages dropped\n";
+		if (write(STDERR_FILENO, note, sizeof(note) - 1) < 0) { /* nowhere to report */ }
+	}
+	logFlushing.clear();
+}
+
+void initLibrary() {
+	// the buffered diagnostics are written also on exit()
+	if (!flushAtExit) {
+		atexit(flushLog);
+		flushAtExit = true;
+	}
+
+	// create a set of signals to be blocked, add SIGVTALRM to it.
+	if (sigemptyset(&alarmSet) != SUCCESS) {
+		logError("system error: sigemptyset failed.");
+		exit(EXIT_FAILURE);
+	}
+	if (sigaddset(&alarmSet, SIGVTALRM) != SUCCESS) {
+		logError("system error: sigaddset failed.");
+		exit(EXIT_FAILURE);
+	}
+
+	// specify the action to be associated with SIGVTALRM. (i.e the handler)
+	sa.sa_handler = &timerHandler;
+	if (sigaction(SIGVTALRM, &sa, nullptr) != SUCCESS) {
+		logError("system error: sigaction failed.");
+		exit(EXIT_FAILURE);
+	}
+
+	// schedule the main thread
+	try {
+		MAIN_THREAD = new Uthread();
+		MAIN_THREAD->quanta++;
+		runningThread = MAIN_THREAD;
+		++totalThreads;
+		++totalQuanta;
+	} catch (std::bad_alloc&) {
+		logError("system error: Memory allocation failed.");
+		exit(EXIT_FAILURE);
+	}
+}
+
 void printInfo() {
 	std::cout << "ALL THREADS" << std::endl;
 	for (auto const &thread : concurrentThreads) {
@@ -151,13 +306,14 @@ void setQuantumTimer(int quantum_usecs) {
 
 //	// Start a virtual timer. It counts down whenever this process is executing.
 //	if (setitimer (ITIMER_VIRTUAL, &timer, nullptr)) {
-//		std::cerr << "system error: setitimer error." << std::endl;
+//		logError("system error: setitimer error.");
 //		exit(EXIT_FAILURE);
 //	}
 }
 
 
 void timerHandler(int sig) {
+	inTimerHandler = 1;
 	// save the running thread context
 	int ret_val = sigsetjmp(runningThread->env, 1);
 	/* if returned from previous saved context, that means it is in the
@@ -177,7 +333,7 @@ void timerHandler(int sig) {
 	if ((nextTID == runningThread->tid) &&
 		isBlocked(runningThread->tid) && isWaiting(runningThread->tid))
 	{
-		std::cerr << "DEADLOCK: READY & RUNNING are empty" << std::endl;
+		logError("DEADLOCK: READY & RUNNING are empty");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
@@ -196,9 +352,42 @@ void timerHandler(int sig) {
 	++totalQuanta;
 
 	// jump to the next ready thread (=running thread now)
+	inTimerHandler = 0;
 	siglongjmp(runningThread->env, 1);
 }
 
+/**
+ * @brief xorshift64* generator, gives the same sequence for a seed on every platform.
+ */
+unsigned long long nextRandom() {
+	prngState ^= prngState >> 12;
+	prngState ^= prngState << 25;
+	prngState ^= prngState >> 27;
+	return prngState * 2685821657736338717ULL;
+}
+
+/**
+ * @brief a point where the running thread may be preempted in the deterministic
+ * 		  modes. If the quantum ends here, the point is recorded and a scheduling
+ * 		  decision is made, exactly as if the timer expired.
+ */
+void preemptionPoint() {
+	if (scheduleMode == TIMER_MODE) { return; }
+	const long point = totalPoints++;
+	bool preempt;
+	if (scheduleMode == RANDOM_MODE) {
+		preempt = nextRandom() % quantumPoints == 0;
+	} else {
+		preempt = nextReplaySwitch < replaySwitches.size() &&
+				  replaySwitches[nextReplaySwitch] == point;
+		if (preempt) { ++nextReplaySwitch; }
+	}
+	if (preempt) {
+		recordedSwitches.push_back(point);
+		raise(SIGVTALRM);
+	}
+}
+
 int setThreadID() {
 	if (totalThreads <= MAX_THREAD_NUM) {
 		for (int i=0; i<MAX_THREAD_NUM; ++i) {
@@ -244,10 +433,26 @@ bool isWaiting(int tid) {
 //				  [tid] (int i) { return i==tid; });
 }
 
+void releaseThread(Uthread* thread) {
+	if (thread == nullptr) { return; }
+	if (thread->slab == nullptr) {
+		delete thread;
+		return;
+	}
+	Slab* slab = thread->slab;
+	thread->~Uthread();
+	if (--slab->liveThreads == 0) {
+		delete[] slab->memory;
+		delete slab;
+	}
+}
+
 void terminateProcess() {
+	flushLog();
 	for (auto &thread : concurrentThreads) {
-		delete thread;
+		releaseThread(thread);
 	}
+	if (finishedThread != runningThread) { releaseThread(finishedThread); }
 //	exit(EXIT_SUCCESS);
 }
 
@@ -259,38 +464,11 @@ void terminateProcess() {
 int uthread_init (int quantum_usecs)
 {
 	if (quantum_usecs <= 0) {
-		std::cerr << "thread library error: non-positive quantum" << std::endl;
+		logError("thread library error: non-positive quantum");
 		return FAILURE;
 	}
 
-	// create a set of signals to be blocked, add SIGVTALRM to it.
-	if (sigemptyset(&alarmSet) != SUCCESS) {
-		std::cerr << "system error: sigemptyset failed." << std::endl;
-		exit(EXIT_FAILURE);
-	}
-	if (sigaddset(&alarmSet, SIGVTALRM) != SUCCESS) {
-		std::cerr << "system error: sigaddset failed." << std::endl;
-		exit(EXIT_FAILURE);
-	}
-
-	// specify the action to be associated with SIGVTALRM. (i.e the handler)
-	sa.sa_handler = &timerHandler;
-	if (sigaction(SIGVTALRM, &sa, nullptr) != SUCCESS) {
-		std::cerr << "system error: sigaction failed." << std::endl;
-		exit(EXIT_FAILURE);
-	}
-
-	// schedule the main thread
-	try {
-		MAIN_THREAD = new Uthread();
-		MAIN_THREAD->quanta++;
-		runningThread = MAIN_THREAD;
-		++totalThreads;
-		++totalQuanta;
-	} catch (std::bad_alloc&) {
-		std::cerr << "system error: Memory allocation failed." << std::endl;
-		exit(EXIT_FAILURE);
-	}
+	initLibrary();
 
 	// setup the quanta timer (sends SIGVTALRM signal over intervals).
 	setQuantumTimer(quantum_usecs);
@@ -301,25 +479,25 @@ int uthread_init (int quantum_usecs)
 int uthread_spawn (void (*f) (void))
 {
 //	if (sigprocmask(SIG_BLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 	if (setitimer (ITIMER_VIRTUAL, &stopTimer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
 
 	if (f == nullptr) {
-		std::cerr << "thread library error: invalid thread entry." << std::endl;
+		logError("thread library error: invalid thread entry.");
 //		sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr);
 		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
 		return FAILURE;
 	}
 	const int tid = setThreadID();
 	if (tid == FAILURE) {
-		std::cerr << "thread library error: threads out of limit." << std::endl;
+		logError("thread library error: threads out of limit.");
 //		sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr);
 		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
 		return FAILURE;
@@ -331,19 +509,19 @@ int uthread_spawn (void (*f) (void))
 		++totalThreads;
 		readyThreads.push_back(tid);
 	} catch (std::bad_alloc&) {
-		std::cerr << "system error: Memory allocation failed." << std::endl;
+		logError("system error: Memory allocation failed.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
 
 //	if (sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 
 	if (setitimer (ITIMER_VIRTUAL, &timer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
@@ -351,22 +529,77 @@ int uthread_spawn (void (*f) (void))
 	return tid;
 }
 
+int uthread_spawn_batch (void (*fns[]) (void), int n, int* out_tids)
+{
+	if (setitimer (ITIMER_VIRTUAL, &stopTimer, nullptr)) {
+		logError("system error: setitimer error.");
+		terminateProcess();
+		exit(EXIT_FAILURE);
+	}
+
+	if (fns == nullptr || out_tids == nullptr || n <= 0) {
+		logError("thread library error: invalid batch.");
+		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
+		return FAILURE;
+	}
+	for (int i = 0; i < n; ++i) {
+		if (fns[i] == nullptr) {
+			logError("thread library error: invalid thread entry.");
+			setitimer (ITIMER_VIRTUAL, &timer, nullptr);
+			return FAILURE;
+		}
+	}
+	if (totalThreads + n > MAX_THREAD_NUM) {
+		logError("thread library error: threads out of limit.");
+		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
+		return FAILURE;
+	}
+
+	// schedule the spawned threads, all of them live in one slab
+	try {
+		Slab* slab = new Slab{nullptr, n};
+		slab->memory = new char[n * SLAB_STRIDE];
+		int tid = 0;
+		for (int i = 0; i < n; ++i, ++tid) {
+			while (concurrentThreads[tid] != nullptr) { ++tid; }
+			char* block = slab->memory + i * SLAB_STRIDE;
+			char* stack = block + SLAB_STRIDE - STACK_SIZE;
+			concurrentThreads[tid] = new (block) Uthread(tid, fns[i], stack, slab);
+			readyThreads.push_back(tid);
+			out_tids[i] = tid;
+		}
+		totalThreads += n;
+	} catch (std::bad_alloc&) {
+		logError("system error: Memory allocation failed.");
+		terminateProcess();
+		exit(EXIT_FAILURE);
+	}
+
+	if (setitimer (ITIMER_VIRTUAL, &timer, nullptr)) {
+		logError("system error: setitimer error.");
+		terminateProcess();
+		exit(EXIT_FAILURE);
+	}
+
+	return SUCCESS;
+}
+
 int uthread_terminate (int tid)
 {
 //	if (sigprocmask(SIG_BLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 
 	if (setitimer (ITIMER_VIRTUAL, &stopTimer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
 
 	if (tid < 0 || tid >= MAX_THREAD_NUM || concurrentThreads[tid] == nullptr) {
-		std::cerr << "thread library error: no such a thread" << std::endl;
+		logError("thread library error: no such a thread");
 //		sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr);
 		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
 		return FAILURE;
@@ -389,16 +622,22 @@ int uthread_terminate (int tid)
 		mutexWaitingThreads.pop_front();
 		if (!isBlocked(waiting)) { readyThreads.push_back(waiting); }
 	}
-	delete concurrentThreads[tid];
+	const bool terminatesItself = (tid == runningThread->tid);
+	if (terminatesItself) {
+		releaseThread(finishedThread);
+		finishedThread = concurrentThreads[tid];
+	} else {
+		releaseThread(concurrentThreads[tid]);
+	}
 	concurrentThreads[tid] = nullptr;
 	--totalThreads;
 
 	// the thread terminates itself
-	if (tid == runningThread->tid) {
+	if (terminatesItself) {
 		const int nextTID = getReadyThread();
 		// if READY is empty
 		if (nextTID == runningThread->tid) {
-			std::cerr << "DEADLOCK: READY & RUNNING are empty" << std::endl;
+			logError("DEADLOCK: READY & RUNNING are empty");
 			terminateProcess();
 			exit(EXIT_FAILURE);
 		}
@@ -412,13 +651,13 @@ int uthread_terminate (int tid)
 	}
 
 //	if (sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 
 	if (setitimer (ITIMER_VIRTUAL, &timer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
@@ -429,25 +668,25 @@ int uthread_terminate (int tid)
 int uthread_block (int tid)
 {
 //	if (sigprocmask(SIG_BLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 	if (setitimer (ITIMER_VIRTUAL, &stopTimer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
 
 	if (tid < 0 || tid >= MAX_THREAD_NUM || concurrentThreads[tid] == nullptr) {
-		std::cerr << "thread library error: no such a thread" << std::endl;
+		logError("thread library error: no such a thread");
 //		sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr);
 		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
 		return FAILURE;
 	}
 	// try to block the main thread
 	if (tid == MAIN_THREAD->tid) {
-		std::cerr << "thread library error: can not block main thread" << std::endl;
+		logError("thread library error: can not block main thread");
 //		sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr);
 		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
 		return FAILURE;
@@ -467,13 +706,13 @@ int uthread_block (int tid)
 	}
 
 //	if (sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 
 	if (setitimer (ITIMER_VIRTUAL, &timer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
@@ -484,19 +723,19 @@ int uthread_block (int tid)
 int uthread_resume (int tid)
 {
 //	if (sigprocmask(SIG_BLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 
 	if (setitimer (ITIMER_VIRTUAL, &stopTimer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
 
 	if (tid < 0 || tid >= MAX_THREAD_NUM || concurrentThreads[tid] == nullptr) {
-		std::cerr << "thread library error: no such a thread." << std::endl;
+		logError("thread library error: no such a thread.");
 //		sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr);
 		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
 		return FAILURE;
@@ -510,13 +749,13 @@ int uthread_resume (int tid)
 	}
 
 //	if (sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 
 	if (setitimer (ITIMER_VIRTUAL, &timer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
@@ -527,13 +766,13 @@ int uthread_resume (int tid)
 int uthread_mutex_lock ()
 {
 //	if (sigprocmask(SIG_BLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 
 	if (setitimer (ITIMER_VIRTUAL, &stopTimer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
@@ -547,8 +786,8 @@ int uthread_mutex_lock ()
 	}
 	// the mutex is already locked by this thread
 	if (mutex.tid == runningThread->tid) {
-		std::cerr << "thread library error: the mutex is already locked by "
-			         "this thread." << std::endl;
+		logError("thread library error: the mutex is already locked by "
+			         "this thread.");
 //		sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr);
 		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
 		return FAILURE;
@@ -576,12 +815,12 @@ int uthread_mutex_lock ()
 	}
 
 //	if (sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 	if (setitimer (ITIMER_VIRTUAL, &timer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
@@ -592,27 +831,27 @@ int uthread_mutex_lock ()
 int uthread_mutex_unlock ()
 {
 //	if (sigprocmask(SIG_BLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 	if (setitimer (ITIMER_VIRTUAL, &stopTimer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
 
 	// the mutex is already unlocked
 	if (!mutex.isLocked) {
-		std::cerr << "thread library error: the mutex is already unlocked." << std::endl;
+		logError("thread library error: the mutex is already unlocked.");
 //		sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr);
 		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
 		return FAILURE;
 	}
 	// only the thread which locked the mutex can release it
 	if (mutex.tid != runningThread->tid) {
-		std::cerr << "thread library error: only the thread which locked the "
-			   		 "mutex can release it." << std::endl;
+		logError("thread library error: only the thread which locked the "
+			   		 "mutex can release it.");
 //		sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr);
 		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
 		return FAILURE;
@@ -636,12 +875,12 @@ int uthread_mutex_unlock ()
 	}
 
 //	if (sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 	if (setitimer (ITIMER_VIRTUAL, &timer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
@@ -649,47 +888,142 @@ int uthread_mutex_unlock ()
 	return SUCCESS;
 }
 
+int uthread_init_deterministic (unsigned int seed, int quantum_points)
+{
+	if (quantum_points <= 0) {
+		logError("thread library error: non-positive quantum");
+		return FAILURE;
+	}
+	scheduleMode = RANDOM_MODE;
+	prngState = ((unsigned long long) seed << 1) | 1;	// xorshift state must be non-zero
+	quantumPoints = quantum_points;
+	initLibrary();
+	return SUCCESS;
+}
+
+int uthread_init_replay (const long* schedule, int length)
+{
+	if (length < 0 || (schedule == nullptr && length > 0)) {
+		logError("thread library error: invalid schedule.");
+		return FAILURE;
+	}
+	scheduleMode = REPLAY_MODE;
+	replaySwitches.assign(schedule, schedule + length);
+	initLibrary();
+	return SUCCESS;
+}
+
+int uthread_preemption_point ()
+{
+	preemptionPoint();
+	return SUCCESS;
+}
+
+int uthread_get_schedule (long* schedule, int max_length)
+{
+	const int length = (int) recordedSwitches.size();
+	for (int i = 0; schedule != nullptr && i < length && i < max_length; ++i) {
+		schedule[i] = recordedSwitches[i];
+	}
+	return length;
+}
+
+void uthread_log_flush ()
+{
+	flushLog();
+}
+
 int uthread_get_tid ()
 {
+	preemptionPoint();
 	return runningThread->tid;
 }
 
 int uthread_get_total_quantums ()
 {
+	preemptionPoint();
 	return totalQuanta;
 }
 
 int uthread_get_quantums (int tid)
 {
+	preemptionPoint();
 //	if (sigprocmask(SIG_BLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 
 	if (setitimer (ITIMER_VIRTUAL, &stopTimer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
 
 	if (tid < 0 || tid >= MAX_THREAD_NUM || concurrentThreads[tid] == nullptr) {
-		std::cerr << "thread library error: no such a thread." << std::endl;
+		logError("thread library error: no such a thread.");
 		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
 		return FAILURE;
 	}
 
 //	if (sigprocmask(SIG_UNBLOCK, &alarmSet, nullptr) != SUCCESS) {
-//		std::cerr << "system error: sigprocmask failed." << std::endl;
+//		logError("system error: sigprocmask failed.");
 //		terminateProcess();
 //		exit(EXIT_FAILURE);
 //	}
 
 	if (setitimer (ITIMER_VIRTUAL, &timer, nullptr)) {
-		std::cerr << "system error: setitimer error." << std::endl;
+		logError("system error: setitimer error.");
 		terminateProcess();
 		exit(EXIT_FAILURE);
 	}
 
 	return concurrentThreads[tid]->quanta;
 }
+
+int uthread_key_create (uthread_key_t* key)
+{
+	if (setitimer (ITIMER_VIRTUAL, &stopTimer, nullptr)) {
+		logError("system error: setitimer error.");
+		terminateProcess();
+		exit(EXIT_FAILURE);
+	}
+
+	if (key == nullptr) {
+		logError("thread library error: invalid key pointer.");
+		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
+		return FAILURE;
+	}
+	if (totalKeys >= MAX_KEY_NUM) {
+		logError("thread library error: keys out of limit.");
+		setitimer (ITIMER_VIRTUAL, &timer, nullptr);
+		return FAILURE;
+	}
+	*key = totalKeys++;
+
+	if (setitimer (ITIMER_VIRTUAL, &timer, nullptr)) {
+		logError("system error: setitimer error.");
+		terminateProcess();
+		exit(EXIT_FAILURE);
+	}
+
+	return SUCCESS;
+}
+
+int uthread_setspecific (uthread_key_t key, const void* value)
+{
+	/* no need to stop the timer, the slot belongs to the running thread only,
+	 * and runningThread is the same whenever this thread is back to RUNNING. */
+	if (key < 0 || key >= totalKeys) {
+		logError("thread library error: no such a key.");
+		return FAILURE;
+	}
+	runningThread->specific[key] = const_cast<void*>(value);
+	return SUCCESS;
+}
+
+void* uthread_getspecific (uthread_key_t key)
+{
+	if (key < 0 || key >= totalKeys) { return nullptr; }
+	return runningThread->specific[key];
+}
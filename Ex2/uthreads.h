@@ -8,6 +8,9 @@
 
 #define MAX_THREAD_NUM 100 /* maximal number of threads */
 #define STACK_SIZE 4096 /* stack size per thread (in bytes) */
+#define MAX_KEY_NUM 64 /* maximal number of thread-specific data keys */
+
+typedef int uthread_key_t; /* identifier of a thread-specific data slot */
 
 /* External interface */
 
@@ -22,6 +25,47 @@
 */
 int uthread_init(int quantum_usecs);
 
+/*
+ * Description: This function initializes the thread library in deterministic
+ * mode, instead of uthread_init. No timer is used: a quantum may end only at
+ * a preemption point, that is a call to uthread_preemption_point,
+ * uthread_get_tid, uthread_get_total_quantums or uthread_get_quantums. At each
+ * point the quantum ends with probability 1/quantum_points, as decided by a
+ * PRNG seeded with seed, so the same seed gives the same interleaving. It is
+ * an error to call this function with non-positive quantum_points.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_init_deterministic(unsigned int seed, int quantum_points);
+
+
+/*
+ * Description: This function initializes the thread library in deterministic
+ * mode, instead of uthread_init, replaying a schedule recorded by
+ * uthread_get_schedule: the quantum ends exactly at the preemption points
+ * schedule[0], ..., schedule[length-1] (counted from 0 since initialization).
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_init_replay(const long* schedule, int length);
+
+
+/*
+ * Description: This function is a preemption point of the deterministic
+ * mode, the running thread may be preempted here. In timer mode it has no
+ * effect.
+ * Return value: 0.
+*/
+int uthread_preemption_point();
+
+
+/*
+ * Description: This function copies up to max_length of the preemption
+ * points where quanta ended by preemption so far (in deterministic mode) into
+ * schedule, so that the run can be replayed with uthread_init_replay.
+ * Return value: The number of recorded preemption points.
+*/
+int uthread_get_schedule(long* schedule, int max_length);
+
+
 /*
  * Description: This function creates a new thread, whose entry point is the
  * function f with the signature void f(void). The thread is added to the end
@@ -35,6 +79,21 @@ int uthread_init(int quantum_usecs);
 int uthread_spawn(void (*f)(void));
 
 
+/*
+ * Description: This function creates n new threads at once, whose entry
+ * points are fns[0], ..., fns[n-1], and adds them to the end of the READY
+ * threads list in that order. The threads and their stacks are allocated
+ * together, and the timer is stopped only once for the whole batch, so
+ * spawning many threads is cheaper than calling uthread_spawn n times.
+ * The function should fail, without spawning any thread, if it would cause
+ * the number of concurrent threads to exceed the limit (MAX_THREAD_NUM) or if
+ * one of the entry points is NULL.
+ * Return value: On success, return 0 and store the IDs of the created threads
+ * in out_tids[0], ..., out_tids[n-1]. On failure, return -1.
+*/
+int uthread_spawn_batch(void (*fns[])(void), int n, int* out_tids);
+
+
 /*
  * Description: This function terminates the thread with ID tid and deletes
  * it from all relevant control structures. All the resources allocated by
@@ -93,6 +152,15 @@ int uthread_mutex_lock();
 int uthread_mutex_unlock();
 
 
+/*
+ * Description: The library does not write its error messages directly to
+ * stderr, so that it never blocks inside the scheduler. The messages are kept
+ * in a buffer, which is written to stderr when an error is reported outside
+ * the scheduler, by this function, and when the process exits.
+*/
+void uthread_log_flush();
+
+
 /*
  * Description: This function returns the thread ID of the calling thread.
  * Return value: The ID of the calling thread.
@@ -123,5 +191,35 @@ int uthread_get_total_quantums();
 */
 int uthread_get_quantums(int tid);
 
+
+/*
+ * Description: This function creates a new thread-specific data key, and
+ * stores it in the location pointed to by key. The key is visible to all the
+ * threads, but each thread has its own value associated with it, initially
+ * NULL (also for threads which are spawned later). It is an error to create
+ * more than MAX_KEY_NUM keys, or to pass a NULL key.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_key_create(uthread_key_t* key);
+
+
+/*
+ * Description: This function associates value with the given key for the
+ * calling thread only. The value of the key in the other threads is not
+ * affected. If the key was not created by uthread_key_create it is
+ * considered an error.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_setspecific(uthread_key_t key, const void* value);
+
+
+/*
+ * Description: This function returns the value currently associated with the
+ * given key in the calling thread.
+ * Return value: The value associated with key, or NULL if no value was set
+ * by the calling thread or the key is invalid.
+*/
+void* uthread_getspecific(uthread_key_t key);
+
 #endif
 
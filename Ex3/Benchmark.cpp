@@ -0,0 +1,984 @@
+#include "MapReduceFramework.h"
+#include "MapReduce.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// usage: Benchmark <mode> [inputs] [threads]
+//   affinity - throughput of a counting job without pinning and with each affinity policy.
+//   shuffle  - throughput of a counting job with the sort shuffle and with the hash shuffle.
+//   combine  - throughput of a counting job without and with a combiner, in both shuffle modes.
+//   skew     - throughput of a counting job where half of the inputs have the same key,
+//              with a plain reduce and with an associative (splittable) one.
+//   tiny     - throughput of a job with very cheap map calls, which rarely emit (try 10M inputs).
+//   output   - throughput of a reduce-heavy job, which emits an output pair for every value.
+//   executor - rate of 1000 small counting jobs of inputs/1000 inputs each, run one after
+//              the other with startMapReduceJob and on a MapReduceExecutor.
+//   fair     - latency of a small job (inputs/100 inputs) on an executor which runs a batch
+//              job, alone, at the batch priority and at a higher priority, and the finish
+//              times of two equal batch jobs of weights 1 and 3.
+//   spill    - throughput of a counting job in memory, and spilling every 64K pairs per thread.
+//   records  - throughput and peak memory of a counting job of 100000 keys which emits flat
+//              records, and of the same job with pairs of objects.
+//   typed    - throughput of a counting job of 100000 keys with the MapReduce template, and
+//              with MapReduceClient.
+//   alloc    - throughput of a counting job whose pairs are allocated with new and deleted in
+//              reduce, and of the same job with pairs allocated with mr_new.
+//   source   - throughput and peak memory of counting the numbers of a file of `inputs` lines,
+//              streamed from an mmap input source, and loaded into an InputVec first.
+//   pipeline - latency of a hash grouping job where half of the inputs have the same key,
+//              with barriers between the phases, and pipelined.
+//   chain    - time of 5 rounds of an iterative job, each a new job whose input vector is
+//              made of the output of the last one, and as a MapReduceChain on an executor.
+//   poll     - time of a counting job alone, and while another thread calls getJobState in
+//              a loop, with the mean and the longest time of a getJobState call.
+//   cache    - cache misses (last level and L1 data reads) per emitted pair of a counting job,
+//              in both shuffle modes, from the hardware counters of perf_event_open. Where
+//              the counters are not available, only the times are printed.
+//   sink     - time to the first consumed output pair, total time and peak memory of a
+//              reduce-heavy job, with the output written to an OutputSink, and added to an
+//              OutputVec which is consumed when the job ends.
+//   range    - throughput of a counting job of 100000 keys whose client overrides only reduce
+//              (the default reduceRange), and of the same job reading the pairs in place.
+
+class KInt : public K1, public K2, public K3 {
+public:
+	KInt(int n) : n(n) { }
+	virtual bool operator<(const K1 &other) const {
+		return n < static_cast<const KInt&>(other).n;
+	}
+	virtual bool operator<(const K2 &other) const {
+		return n < static_cast<const KInt&>(other).n;
+	}
+	virtual bool operator<(const K3 &other) const {
+		return n < static_cast<const KInt&>(other).n;
+	}
+	virtual size_t hash() const { return (size_t) n; }
+	int n;
+};
+
+class VInt : public V1, public V2, public V3 {
+public:
+	VInt(int n) : n(n) { }
+	int n;
+};
+
+// counts the input numbers modulo `keys`
+class CountClient : public MapReduceClient {
+public:
+	CountClient(int keys, bool hashed = false, bool combining = false, bool associative = false)
+		: keys(keys), hashed(hashed), combining(combining), associative(associative) { }
+
+	void map(const K1* key, const V1* value, void* context) const {
+		int n = static_cast<const VInt*>(value)->n;
+		emit2(new KInt(n % keys), new VInt(1), context);
+	}
+
+	virtual void reduce(const IntermediateVec* pairs, void* context) const {
+		reduceRange(pairs->data(), pairs->data() + pairs->size(), context);
+	}
+
+	virtual void reduceRange(const IntermediatePair* begin, const IntermediatePair* end,
+							 void* context) const {
+		int k = static_cast<const KInt*>(begin->first)->n;
+		int count = 0;
+		for (const IntermediatePair* pair = begin; pair != end; ++pair) {
+			count += static_cast<const VInt*>(pair->second)->n;
+			delete pair->first;
+			delete pair->second;
+		}
+		emit3(new KInt(k), new VInt(count), context);
+	}
+
+	virtual bool groupByHash() const { return hashed; }
+
+	virtual bool hasCombiner() const { return combining; }
+
+	virtual void combine(const IntermediatePair* begin, const IntermediatePair* end,
+						 void* context) const {
+		int k = static_cast<const KInt*>(begin->first)->n;
+		int count = 0;
+		for (const IntermediatePair* pair = begin; pair != end; ++pair) {
+			count += static_cast<const VInt*>(pair->second)->n;
+			delete pair->first;
+			delete pair->second;
+		}
+		emit2(new KInt(k), new VInt(count), context);
+	}
+
+	virtual bool isReduceAssociative() const { return associative; }
+
+	int keys;
+	bool hashed;
+	bool combining;
+	bool associative;
+};
+
+// a CountClient which overrides only reduce, as clients written before reduceRange
+class VectorCountClient : public CountClient {
+public:
+	VectorCountClient(int keys) : CountClient(keys) { }
+
+	virtual void reduce(const IntermediateVec* pairs, void* context) const {
+		int count = 0;
+		for (const IntermediatePair& pair : *pairs) {
+			count += static_cast<const VInt*>(pair.second)->n;
+		}
+		emit3(new KInt(static_cast<const KInt*>(pairs->front().first)->n), new VInt(count), context);
+		for (const IntermediatePair& pair : *pairs) {
+			delete pair.first;
+			delete pair.second;
+		}
+	}
+
+	virtual void reduceRange(const IntermediatePair* begin, const IntermediatePair* end,
+							 void* context) const {
+		MapReduceClient::reduceRange(begin, end, context);
+	}
+};
+
+// counts half of the input numbers under the key 0, and the rest modulo `keys`
+class SkewClient : public CountClient {
+public:
+	SkewClient(int keys, bool associative, bool hashed = false, bool pipelining = false)
+		: CountClient(keys, hashed, false, associative), pipelining(pipelining) { }
+
+	void map(const K1* key, const V1* value, void* context) const {
+		int n = static_cast<const VInt*>(value)->n;
+		emit2(new KInt((n % 2 == 0) ? 0 : n % keys), new VInt(1), context);
+	}
+
+	// the combiner is used only to split the hot key in the reduce phase
+	virtual bool hasCombiner() const { return associative; }
+
+	virtual bool pipelined() const { return pipelining; }
+
+	bool pipelining;
+};
+
+// a line of text, the input value of LineCountClient
+class Line : public V1 {
+public:
+	Line(const char* text, size_t size) : text(text), size(size) { }
+	const char* text;
+	size_t size;
+};
+
+// counts the numbers of the input lines modulo `keys`
+class LineCountClient : public CountClient {
+public:
+	LineCountClient(int keys) : CountClient(keys) { }
+
+	void map(const K1* key, const V1* value, void* context) const {
+		const Line* line = static_cast<const Line*>(value);
+		int n = 0;
+		for (size_t i = 0; i < line->size; ++i) { n = n * 10 + (line->text[i] - '0'); }
+		emit2(new KInt(n % keys), new VInt(1), context);
+	}
+};
+
+// an input source of the lines of a file, which is mapped to memory. the pages
+// are read by the kernel as the lines are mapped, and released after them.
+class MmapLineSource : public InputSource {
+public:
+	explicit MmapLineSource(const char* path) {
+		int fd = open(path, O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			fprintf(stderr, "cannot open %s\n", path);
+			exit(1);
+		}
+		size = st.st_size;
+		text = static_cast<const char*>(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+		close(fd);
+		if (text == MAP_FAILED) {
+			fprintf(stderr, "cannot map %s\n", path);
+			exit(1);
+		}
+		madvise((void*) text, size, MADV_SEQUENTIAL);
+		next = 0;
+	}
+
+	~MmapLineSource() { munmap((void*) text, size); }
+
+	size_t read(InputPair* pairs, size_t max) {
+		size_t count = 0;
+		while (count < max && next < size) {
+			const char* end = static_cast<const char*>(memchr(text + next, '\n', size - next));
+			size_t length = (end == nullptr) ? size - next : end - (text + next);
+			pairs[count++] = InputPair(nullptr, new Line(text + next, length));
+			next += length + 1;
+		}
+		return count;
+	}
+
+	void release(InputPair* pairs, size_t count) {
+		for (size_t i = 0; i < count; ++i) { delete pairs[i].second; }
+	}
+
+private:
+	const char* text;
+	size_t size;
+	size_t next;
+};
+
+// a CountClient which allocates its intermediate pairs in the arena of the job
+class ArenaCountClient : public CountClient {
+public:
+	ArenaCountClient(int keys) : CountClient(keys) { }
+
+	void map(const K1* key, const V1* value, void* context) const {
+		int n = static_cast<const VInt*>(value)->n;
+		emit2(mr_new<KInt>(context, n % keys), mr_new<VInt>(context, 1), context);
+	}
+
+	virtual void reduceRange(const IntermediatePair* begin, const IntermediatePair* end,
+							 void* context) const {
+		int count = 0;
+		for (const IntermediatePair* pair = begin; pair != end; ++pair) {
+			count += static_cast<const VInt*>(pair->second)->n;
+		}
+		emit3(new KInt(static_cast<const KInt*>(begin->first)->n), new VInt(count), context);
+	}
+};
+
+// a CountClient which spills its pairs to disk, as two ints
+class SpillClient : public CountClient {
+public:
+	SpillClient(int keys, size_t threshold, bool combining = false)
+		: CountClient(keys, false, combining), threshold(threshold) { }
+
+	virtual size_t spillThreshold() const { return threshold; }
+
+	virtual void serializePair(K2* key, V2* value, std::string& record) const {
+		int fields[2] = {static_cast<KInt*>(key)->n, static_cast<VInt*>(value)->n};
+		record.append(reinterpret_cast<const char*>(fields), sizeof(fields));
+		delete key;
+		delete value;
+	}
+
+	virtual IntermediatePair deserializePair(const char* record, size_t size) const {
+		int fields[2];
+		memcpy(fields, record, sizeof(fields));
+		return IntermediatePair(new KInt(fields[0]), new VInt(fields[1]));
+	}
+
+	size_t threshold;
+};
+
+// counts the input numbers modulo `keys` with flat records: a big endian key, and a count
+class RecordCountClient : public MapReduceClient {
+public:
+	RecordCountClient(int keys) : keys(keys) { }
+
+	void map(const K1* key, const V1* value, void* context) const {
+		uint32_t n = static_cast<const VInt*>(value)->n % keys;
+		unsigned char k[4] = {(unsigned char) (n >> 24), (unsigned char) (n >> 16),
+							  (unsigned char) (n >> 8), (unsigned char) n};
+		int one = 1;
+		emitRecord(k, sizeof(k), &one, sizeof(one), context);
+	}
+
+	virtual void reduce(const IntermediateVec* pairs, void* context) const { }
+
+	virtual bool usesRecords() const { return true; }
+
+	virtual void reduceRecords(const IntermediateRecord* begin, const IntermediateRecord* end,
+							   void* context) const {
+		const unsigned char* k = reinterpret_cast<const unsigned char*>(begin->key);
+		int count = 0;
+		for (const IntermediateRecord* record = begin; record != end; ++record) {
+			int n;
+			memcpy(&n, record->value, sizeof(n));
+			count += n;
+		}
+		emit3(new KInt((k[0] << 24) | (k[1] << 16) | (k[2] << 8) | k[3]), new VInt(count), context);
+	}
+
+	int keys;
+};
+
+// groups the input numbers modulo `keys`, and outputs every number of each group
+class FanOutClient : public MapReduceClient {
+public:
+	FanOutClient(int keys) : keys(keys) { }
+
+	void map(const K1* key, const V1* value, void* context) const {
+		int n = static_cast<const VInt*>(value)->n;
+		emit2(new KInt(n % keys), new VInt(n), context);
+	}
+
+	virtual void reduce(const IntermediateVec* pairs, void* context) const {
+		for (const IntermediatePair& pair: *pairs) {
+			emit3(new KInt(static_cast<const KInt*>(pair.first)->n),
+				  new VInt(static_cast<const VInt*>(pair.second)->n), context);
+			delete pair.first;
+			delete pair.second;
+		}
+	}
+
+	int keys;
+};
+
+// one round of an iterative job: regroups the values by a hash of the value and
+// the round, and outputs every value again, so every round has all the pairs
+class RoundClient : public MapReduceClient {
+public:
+	RoundClient(int round) : round(round) { }
+
+	void map(const K1* key, const V1* value, void* context) const {
+		int n = static_cast<const VInt*>(value)->n;
+		emit2(new KInt((int) ((unsigned) (n + round) * 2654435761u % 4096)), new VInt(n), context);
+	}
+
+	virtual void reduce(const IntermediateVec* pairs, void* context) const {
+		for (const IntermediatePair& pair: *pairs) {
+			emit3(new KInt(static_cast<const KInt*>(pair.first)->n),
+				  new VInt(static_cast<const VInt*>(pair.second)->n), context);
+			delete pair.first;
+			delete pair.second;
+		}
+	}
+
+	// the pairs are KInt and VInt, which are cheaper to cast statically
+	virtual InputPair chainInput(K3* key, V3* value) const {
+		return InputPair(static_cast<KInt*>(key), static_cast<VInt*>(value));
+	}
+
+	int round;
+};
+
+// an output sink which consumes the output of a FanOutClient job as it arrives
+class CountingSink : public OutputSink {
+public:
+	explicit CountingSink(std::chrono::steady_clock::time_point start) : start(start), count(0) { }
+
+	void write(const OutputPair* pairs, size_t n) {
+		if (count == 0) { first = std::chrono::steady_clock::now(); }
+		count += n;
+		for (size_t i = 0; i < n; ++i) {
+			delete pairs[i].first;
+			delete pairs[i].second;
+		}
+	}
+
+	std::chrono::steady_clock::time_point start, first;
+	size_t count;
+};
+
+// a job of tiny map calls, emits only the input numbers which are multiples of 1024
+class TinyClient : public MapReduceClient {
+public:
+	void map(const K1* key, const V1* value, void* context) const {
+		int n = static_cast<const VInt*>(value)->n;
+		if (n % 1024 == 0) { emit2(new KInt(n % 16), new VInt(1), context); }
+	}
+
+	virtual void reduce(const IntermediateVec* pairs, void* context) const {
+		for (const IntermediatePair& pair: *pairs) {
+			delete pair.first;
+			delete pair.second;
+		}
+	}
+};
+
+struct Input {
+	InputVec vec;
+	std::vector<VInt> values;
+
+	explicit Input(size_t size) {
+		values.reserve(size);
+		for (size_t i = 0; i < size; ++i) {
+			values.emplace_back((int) (i * 2654435761u % 1000003));
+			vec.push_back({nullptr, &values.back()});
+		}
+	}
+};
+
+// frees the output of a CountClient job, and checks that every input was counted once
+void freeOutput(OutputVec& outputVec, size_t inputs) {
+	size_t total = 0;
+	std::vector<int> keys;
+	for (OutputPair& pair: outputVec) {
+		total += static_cast<const VInt*>(pair.second)->n;
+		keys.push_back(static_cast<const KInt*>(pair.first)->n);
+		delete pair.first;
+		delete pair.second;
+	}
+	outputVec.clear();
+	std::sort(keys.begin(), keys.end());
+	if (total != inputs || std::adjacent_find(keys.begin(), keys.end()) != keys.end()) {
+		fprintf(stderr, "wrong output: counted %zu of %zu inputs\n", total, inputs);
+		exit(1);
+	}
+}
+
+double runCount(const Input& input, int threads, int keys, const AffinityPolicy& affinity,
+				bool hashed = false, bool combining = false) {
+	CountClient client(keys, hashed, combining);
+	OutputVec outputVec;
+	auto start = std::chrono::steady_clock::now();
+	JobHandle job = startMapReduceJob(client, input.vec, outputVec, threads, affinity);
+	closeJobHandle(job);
+	auto end = std::chrono::steady_clock::now();
+	freeOutput(outputVec, input.vec.size());
+	return std::chrono::duration<double>(end - start).count();
+}
+
+void benchAffinity(size_t inputs, int threads) {
+	Input input(inputs);
+	const char* names[] = {"none", "compact", "scatter"};
+	affinity_t policies[] = {AFFINITY_NONE, AFFINITY_COMPACT, AFFINITY_SCATTER};
+	for (int i = 0; i < 3; ++i) {
+		AffinityPolicy affinity = {policies[i], nullptr, 0};
+		double seconds = runCount(input, threads, 1024, affinity);
+		printf("affinity %-8s %10.0f records/s\n", names[i], inputs / seconds);
+	}
+}
+
+void benchShuffle(size_t inputs, int threads) {
+	Input input(inputs);
+	AffinityPolicy affinity = {AFFINITY_NONE, nullptr, 0};
+	for (int keys : {16, 100000}) {
+		double sorted = runCount(input, threads, keys, affinity, false);
+		double hashed = runCount(input, threads, keys, affinity, true);
+		printf("shuffle %6d keys: sort %10.0f records/s, hash %10.0f records/s\n",
+			   keys, inputs / sorted, inputs / hashed);
+	}
+}
+
+void benchCombine(size_t inputs, int threads) {
+	Input input(inputs);
+	AffinityPolicy affinity = {AFFINITY_NONE, nullptr, 0};
+	for (bool hashed : {false, true}) {
+		double plain = runCount(input, threads, 64, affinity, hashed, false);
+		double combined = runCount(input, threads, 64, affinity, hashed, true);
+		printf("combine %s shuffle: without %10.0f records/s, with %10.0f records/s\n",
+			   hashed ? "hash" : "sort", inputs / plain, inputs / combined);
+	}
+}
+
+void benchSkew(size_t inputs, int threads) {
+	Input input(inputs);
+	for (bool associative : {false, true}) {
+		SkewClient client(1000, associative);
+		OutputVec outputVec;
+		auto start = std::chrono::steady_clock::now();
+		JobHandle job = startMapReduceJob(client, input.vec, outputVec, threads);
+		closeJobHandle(job);
+		auto end = std::chrono::steady_clock::now();
+		freeOutput(outputVec, inputs);
+		double seconds = std::chrono::duration<double>(end - start).count();
+		printf("skew %-11s %10.0f records/s\n", associative ? "associative" : "plain", inputs / seconds);
+	}
+}
+
+void benchTiny(size_t inputs, int threads) {
+	Input input(inputs);
+	TinyClient client;
+	OutputVec outputVec;
+	auto start = std::chrono::steady_clock::now();
+	JobHandle job = startMapReduceJob(client, input.vec, outputVec, threads);
+	closeJobHandle(job);
+	auto end = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(end - start).count();
+	printf("tiny %10.0f records/s\n", inputs / seconds);
+}
+
+void benchOutput(size_t inputs, int threads) {
+	Input input(inputs);
+	FanOutClient client(64);
+	OutputVec outputVec;
+	auto start = std::chrono::steady_clock::now();
+	JobHandle job = startMapReduceJob(client, input.vec, outputVec, threads);
+	closeJobHandle(job);
+	auto end = std::chrono::steady_clock::now();
+	if (outputVec.size() != inputs) {
+		fprintf(stderr, "wrong output: %zu of %zu pairs\n", outputVec.size(), inputs);
+		exit(1);
+	}
+	for (OutputPair& pair: outputVec) {
+		delete pair.first;
+		delete pair.second;
+	}
+	double seconds = std::chrono::duration<double>(end - start).count();
+	printf("output %10.0f output pairs/s\n", inputs / seconds);
+}
+
+void benchExecutor(size_t inputs, int threads) {
+	const int jobs = 1000;
+	Input input(std::max<size_t>(1, inputs / jobs));
+	CountClient client(16);
+	double seconds[2];
+	MapReduceExecutor executor(threads);
+	for (int pooled = 0; pooled < 2; ++pooled) {
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < jobs; ++i) {
+			OutputVec outputVec;
+			JobHandle job = pooled ? executor.submit(client, input.vec, outputVec, threads)
+								   : startMapReduceJob(client, input.vec, outputVec, threads);
+			closeJobHandle(job);
+			freeOutput(outputVec, input.vec.size());
+		}
+		auto end = std::chrono::steady_clock::now();
+		seconds[pooled] = std::chrono::duration<double>(end - start).count();
+	}
+	printf("executor: threads per job %10.0f jobs/s, pool %10.0f jobs/s\n",
+		   jobs / seconds[0], jobs / seconds[1]);
+}
+
+// submits a small counting job to the executor and returns its latency in seconds
+double smallJobLatency(MapReduceExecutor& executor, const Input& input, int threads, int priority) {
+	CountClient client(16);
+	OutputVec outputVec;
+	JobSchedule schedule = {priority, 1};
+	auto start = std::chrono::steady_clock::now();
+	JobHandle job = executor.submit(client, input.vec, outputVec, threads, schedule);
+	closeJobHandle(job);
+	auto end = std::chrono::steady_clock::now();
+	freeOutput(outputVec, input.vec.size());
+	return std::chrono::duration<double>(end - start).count();
+}
+
+void benchFair(size_t inputs, int threads) {
+	Input batchInput(inputs), smallInput(std::max<size_t>(1, inputs / 100));
+	CountClient batchClient(1024);
+	MapReduceExecutor executor(threads);
+	printf("fair: small job alone %8.2f ms\n", 1000 * smallJobLatency(executor, smallInput, threads, 0));
+	for (int priority : {0, 1}) {
+		OutputVec batchOutput;
+		JobHandle batch = executor.submit(batchClient, batchInput.vec, batchOutput, threads);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		double latency = smallJobLatency(executor, smallInput, threads, priority);
+		closeJobHandle(batch);
+		freeOutput(batchOutput, inputs);
+		printf("fair: small job beside a batch job, priority %d %8.2f ms\n", priority, 1000 * latency);
+	}
+
+	OutputVec outputs[2];
+	JobSchedule schedules[2] = {{0, 1}, {0, 3}};
+	JobHandle jobs[2];
+	double finish[2] = {0, 0};
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < 2; ++i) {
+		jobs[i] = executor.submit(batchClient, batchInput.vec, outputs[i], threads, schedules[i]);
+	}
+	for (int done = 0; done < 2; ) {
+		for (int i = 0; i < 2; ++i) {
+			JobState state;
+			getJobState(jobs[i], &state);
+			if (finish[i] == 0 && state.stage == REDUCE_STAGE && state.percentage >= 100) {
+				finish[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				++done;
+			}
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+	for (int i = 0; i < 2; ++i) {
+		closeJobHandle(jobs[i]);
+		freeOutput(outputs[i], inputs);
+	}
+	printf("fair: batch jobs finish at %8.2f ms (weight 1), %8.2f ms (weight 3)\n",
+		   1000 * finish[0], 1000 * finish[1]);
+}
+
+void benchSpill(size_t inputs, int threads) {
+	Input input(inputs);
+	for (size_t threshold : {0, 65536}) {
+		SpillClient client(100000, threshold);
+		OutputVec outputVec;
+		auto start = std::chrono::steady_clock::now();
+		JobHandle job = startMapReduceJob(client, input.vec, outputVec, threads);
+		closeJobHandle(job);
+		auto end = std::chrono::steady_clock::now();
+		freeOutput(outputVec, inputs);
+		double seconds = std::chrono::duration<double>(end - start).count();
+		printf("spill %-9s %10.0f records/s\n", threshold ? "to disk" : "in memory", inputs / seconds);
+	}
+}
+
+// the peak resident memory of the process so far, in MB
+double peakMemory() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024.0;
+}
+
+void benchRecords(size_t inputs, int threads) {
+	Input input(inputs);
+	double base = peakMemory();
+	// records first, since the peak memory only grows
+	for (bool records : {true, false}) {
+		RecordCountClient recordClient(100000);
+		CountClient pairClient(100000);
+		const MapReduceClient& client = records ? (const MapReduceClient&) recordClient : pairClient;
+		OutputVec outputVec;
+		auto start = std::chrono::steady_clock::now();
+		JobHandle job = startMapReduceJob(client, input.vec, outputVec, threads);
+		closeJobHandle(job);
+		auto end = std::chrono::steady_clock::now();
+		freeOutput(outputVec, inputs);
+		double seconds = std::chrono::duration<double>(end - start).count();
+		printf("records %-7s %10.0f records/s, peak memory +%7.1f MB\n", records ? "flat" : "objects",
+			   inputs / seconds, peakMemory() - base);
+	}
+}
+
+void benchTyped(size_t inputs, int threads) {
+	Input input(inputs);
+	AffinityPolicy affinity = {AFFINITY_NONE, nullptr, 0};
+	double virtualSeconds = runCount(input, threads, 100000, affinity);
+
+	MapReduce<int, int, int, int, int, int>::Input typedInput;
+	for (const VInt& value : input.values) { typedInput.emplace_back(0, value.n); }
+	MapReduce<int, int, int, int, int, int>::Output output;
+	MapReduce<int, int, int, int, int, int> mapReduce(threads);
+	auto start = std::chrono::steady_clock::now();
+	mapReduce.run(typedInput, output,
+		[](int key, int value, MapReduce<int, int, int, int, int, int>::Emit2& emit) {
+			emit(value % 100000, 1);
+		},
+		[](const std::pair<int, int>* begin, const std::pair<int, int>* end,
+		   MapReduce<int, int, int, int, int, int>::Emit3& emit) {
+			int count = 0;
+			for (auto pair = begin; pair != end; ++pair) { count += pair->second; }
+			emit(begin->first, count);
+		});
+	auto end = std::chrono::steady_clock::now();
+	size_t total = 0;
+	for (auto const &pair : output) { total += pair.second; }
+	if (total != inputs) {
+		fprintf(stderr, "wrong output: counted %zu of %zu inputs\n", total, inputs);
+		exit(1);
+	}
+	double typedSeconds = std::chrono::duration<double>(end - start).count();
+	printf("typed: template %10.0f records/s, virtual %10.0f records/s\n",
+		   inputs / typedSeconds, inputs / virtualSeconds);
+}
+
+void benchAlloc(size_t inputs, int threads) {
+	Input input(inputs);
+	for (bool arena : {false, true}) {
+		CountClient heapClient(64);
+		ArenaCountClient arenaClient(64);
+		const MapReduceClient& client = arena ? (const MapReduceClient&) arenaClient : heapClient;
+		OutputVec outputVec;
+		auto start = std::chrono::steady_clock::now();
+		JobHandle job = startMapReduceJob(client, input.vec, outputVec, threads);
+		closeJobHandle(job);
+		auto end = std::chrono::steady_clock::now();
+		freeOutput(outputVec, inputs);
+		double seconds = std::chrono::duration<double>(end - start).count();
+		printf("alloc %-6s %10.0f records/s\n", arena ? "mr_new" : "new", inputs / seconds);
+	}
+}
+
+void benchSource(size_t inputs, int threads) {
+	char path[] = "/tmp/mapreduce-lines-XXXXXX";
+	int fd = mkstemp(path);
+	FILE* file = (fd < 0) ? nullptr : fdopen(fd, "w");
+	if (file == nullptr) {
+		fprintf(stderr, "cannot create %s\n", path);
+		exit(1);
+	}
+	for (size_t i = 0; i < inputs; ++i) { fprintf(file, "%u\n", (unsigned) (i * 2654435761u % 1000003)); }
+	fclose(file);
+
+	LineCountClient client(1024);
+	double base = peakMemory();
+	// the source first, since the peak memory only grows
+	for (bool streaming : {true, false}) {
+		OutputVec outputVec;
+		auto start = std::chrono::steady_clock::now();
+		if (streaming) {
+			MmapLineSource source(path);
+			JobHandle job = startMapReduceJob(client, source, outputVec, threads);
+			closeJobHandle(job);
+		} else {
+			// load the file, and make an input pair of every line
+			FILE* in = fopen(path, "r");
+			std::string text;
+			char buffer[65536];
+			size_t got;
+			while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0) { text.append(buffer, got); }
+			fclose(in);
+			std::vector<Line> lines;
+			for (size_t begin = 0, end; begin < text.size(); begin = end + 1) {
+				end = text.find('\n', begin);
+				if (end == std::string::npos) { end = text.size(); }
+				lines.emplace_back(text.data() + begin, end - begin);
+			}
+			InputVec inputVec;
+			for (Line& line : lines) { inputVec.push_back(InputPair(nullptr, &line)); }
+			JobHandle job = startMapReduceJob(client, inputVec, outputVec, threads);
+			closeJobHandle(job);
+		}
+		auto end = std::chrono::steady_clock::now();
+		freeOutput(outputVec, inputs);
+		double seconds = std::chrono::duration<double>(end - start).count();
+		printf("source %-9s %10.0f lines/s, peak memory +%7.1f MB\n", streaming ? "streamed" : "loaded",
+			   inputs / seconds, peakMemory() - base);
+	}
+	unlink(path);
+}
+
+void benchPipeline(size_t inputs, int threads) {
+	Input input(inputs);
+	for (bool pipelining : {false, true}) {
+		SkewClient client(1000, false, true, pipelining);
+		OutputVec outputVec;
+		auto start = std::chrono::steady_clock::now();
+		JobHandle job = startMapReduceJob(client, input.vec, outputVec, threads);
+		closeJobHandle(job);
+		auto end = std::chrono::steady_clock::now();
+		freeOutput(outputVec, inputs);
+		printf("pipeline %-9s %8.2f ms\n", pipelining ? "pipelined" : "phased",
+			   std::chrono::duration<double, std::milli>(end - start).count());
+	}
+}
+
+void benchChain(size_t inputs, int threads) {
+	const int rounds = 5;
+	Input input(inputs);
+	std::vector<RoundClient> clients;
+	for (int r = 0; r < rounds; ++r) { clients.emplace_back(r); }
+	for (bool chained : {false, true}) {
+		OutputVec outputVec;
+		auto start = std::chrono::steady_clock::now();
+		if (chained) {
+			MapReduceExecutor executor(threads);
+			MapReduceChain chain(executor);
+			for (const RoundClient& client : clients) { chain.addStage(client, threads); }
+			chain.run(input.vec, outputVec);
+		} else {
+			InputVec inputVec = input.vec;
+			for (int r = 0; r < rounds; ++r) {
+				JobHandle job = startMapReduceJob(clients[r], inputVec, outputVec, threads);
+				closeJobHandle(job);
+				// the input of the next round, the input of this round is not needed anymore
+				for (InputPair& pair : inputVec) {
+					if (r > 0) {
+						delete pair.first;
+						delete pair.second;
+					}
+				}
+				inputVec.clear();
+				if (r + 1 < rounds) {
+					for (OutputPair& pair : outputVec) {
+						inputVec.push_back(InputPair(static_cast<KInt*>(pair.first), static_cast<VInt*>(pair.second)));
+					}
+					outputVec.clear();
+				}
+			}
+		}
+		auto end = std::chrono::steady_clock::now();
+		if (outputVec.size() != inputs) {
+			fprintf(stderr, "wrong output: %zu of %zu pairs\n", outputVec.size(), inputs);
+			exit(1);
+		}
+		for (OutputPair& pair: outputVec) {
+			delete pair.first;
+			delete pair.second;
+		}
+		printf("chain %-7s %8.2f ms\n", chained ? "chained" : "restart",
+			   std::chrono::duration<double, std::milli>(end - start).count());
+	}
+}
+
+void benchPoll(size_t inputs, int threads) {
+	Input input(inputs);
+	CountClient client(1024);
+	for (bool polling : {false, true}) {
+		OutputVec outputVec;
+		auto start = std::chrono::steady_clock::now();
+		JobHandle job = startMapReduceJob(client, input.vec, outputVec, threads);
+		uint64_t polls = 0;
+		double longest = 0, total = 0;
+		JobState state = {UNDEFINED_STAGE, 0};
+		while (polling && !(state.stage == REDUCE_STAGE && state.percentage >= 100)) {
+			auto before = std::chrono::steady_clock::now();
+			getJobState(job, &state);
+			double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - before).count();
+			longest = std::max(longest, ns);
+			total += ns;
+			++polls;
+		}
+		closeJobHandle(job);
+		auto end = std::chrono::steady_clock::now();
+		freeOutput(outputVec, inputs);
+		printf("poll %-7s %8.2f ms", polling ? "polled" : "alone",
+			   std::chrono::duration<double, std::milli>(end - start).count());
+		if (polling) {
+			printf(", %llu polls, mean %6.1f ns, longest %8.1f us", (unsigned long long) polls,
+				   total / polls, longest / 1000);
+		}
+		printf("\n");
+	}
+}
+
+// opens a counter of a hardware event of this process and of the threads it creates
+// from then on (their counts are added when they exit), -1 if it is not available
+int openCounter(uint32_t type, uint64_t config) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void benchCache(size_t inputs, int threads) {
+	Input input(inputs);
+	const uint64_t l1Read = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+							(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	int counters[2] = {openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES),
+					   openCounter(PERF_TYPE_HW_CACHE, l1Read)};
+	if (counters[0] < 0) {
+		printf("cache misses are not available (perf_event_open: %s)\n", strerror(errno));
+	}
+	for (bool hashed : {false, true}) {
+		CountClient client(1024, hashed);
+		OutputVec outputVec;
+		for (int fd : counters) {
+			if (fd >= 0) {
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+		auto start = std::chrono::steady_clock::now();
+		JobHandle job = startMapReduceJob(client, input.vec, outputVec, threads);
+		closeJobHandle(job);	// joins the threads, so their counts are added
+		auto end = std::chrono::steady_clock::now();
+		uint64_t misses[2] = {0, 0};
+		for (int i = 0; i < 2; ++i) {
+			if (counters[i] >= 0) {
+				ioctl(counters[i], PERF_EVENT_IOC_DISABLE, 0);
+				if (read(counters[i], &misses[i], sizeof(misses[i])) != sizeof(misses[i])) { misses[i] = 0; }
+			}
+		}
+		freeOutput(outputVec, inputs);
+		printf("cache %s shuffle %8.2f ms", hashed ? "hash" : "sort",
+			   std::chrono::duration<double, std::milli>(end - start).count());
+		// every input emits one pair
+		if (counters[0] >= 0) { printf(", %6.2f cache misses/emit", (double) misses[0] / inputs); }
+		if (counters[1] >= 0) { printf(", %6.2f L1D read misses/emit", (double) misses[1] / inputs); }
+		printf("\n");
+	}
+	for (int fd : counters) {
+		if (fd >= 0) { close(fd); }
+	}
+}
+
+void benchSink(size_t inputs, int threads) {
+	Input input(inputs);
+	FanOutClient client(64);
+	double base = peakMemory();
+	// the sink first, since the peak memory only grows
+	for (bool streaming : {true, false}) {
+		auto start = std::chrono::steady_clock::now();
+		CountingSink sink(start);
+		OutputVec outputVec;
+		JobHandle job = streaming ? startMapReduceJob(client, input.vec, sink, threads) :
+						startMapReduceJob(client, input.vec, outputVec, threads);
+		closeJobHandle(job);
+		// the output vector is consumed only when the job ends
+		if (!streaming) { sink.write(outputVec.data(), outputVec.size()); }
+		auto end = std::chrono::steady_clock::now();
+		if (sink.count != inputs) {
+			fprintf(stderr, "wrong output: %zu of %zu pairs\n", sink.count, inputs);
+			exit(1);
+		}
+		printf("sink %-9s first result after %8.2f ms, total %8.2f ms, peak memory +%7.1f MB\n",
+			   streaming ? "streamed" : "vector",
+			   std::chrono::duration<double, std::milli>(sink.first - start).count(),
+			   std::chrono::duration<double, std::milli>(end - start).count(), peakMemory() - base);
+	}
+}
+
+void benchRange(size_t inputs, int threads) {
+	Input input(inputs);
+	for (bool inPlace : {false, true}) {
+		CountClient rangeClient(100000);
+		VectorCountClient vectorClient(100000);
+		const MapReduceClient& client = inPlace ? static_cast<const MapReduceClient&>(rangeClient) : vectorClient;
+		OutputVec outputVec;
+		auto start = std::chrono::steady_clock::now();
+		JobHandle job = startMapReduceJob(client, input.vec, outputVec, threads);
+		closeJobHandle(job);
+		auto end = std::chrono::steady_clock::now();
+		freeOutput(outputVec, inputs);
+		double seconds = std::chrono::duration<double>(end - start).count();
+		printf("range %-8s %10.0f records/s\n", inPlace ? "in place" : "default", inputs / seconds);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <mode> [inputs] [threads]\n", argv[0]);
+		return 1;
+	}
+	size_t inputs = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 1000000;
+	int threads = (argc > 3) ? atoi(argv[3]) : (int) std::thread::hardware_concurrency();
+	if (threads < 1) { threads = 1; }
+
+	if (strcmp(argv[1], "affinity") == 0) {
+		benchAffinity(inputs, threads);
+	} else if (strcmp(argv[1], "shuffle") == 0) {
+		benchShuffle(inputs, threads);
+	} else if (strcmp(argv[1], "combine") == 0) {
+		benchCombine(inputs, threads);
+	} else if (strcmp(argv[1], "skew") == 0) {
+		benchSkew(inputs, threads);
+	} else if (strcmp(argv[1], "tiny") == 0) {
+		benchTiny(inputs, threads);
+	} else if (strcmp(argv[1], "output") == 0) {
+		benchOutput(inputs, threads);
+	} else if (strcmp(argv[1], "executor") == 0) {
+		benchExecutor(inputs, threads);
+	} else if (strcmp(argv[1], "fair") == 0) {
+		benchFair(inputs, threads);
+	} else if (strcmp(argv[1], "spill") == 0) {
+		benchSpill(inputs, threads);
+	} else if (strcmp(argv[1], "records") == 0) {
+		benchRecords(inputs, threads);
+	} else if (strcmp(argv[1], "typed") == 0) {
+		benchTyped(inputs, threads);
+	} else if (strcmp(argv[1], "alloc") == 0) {
+		benchAlloc(inputs, threads);
+	} else if (strcmp(argv[1], "source") == 0) {
+		benchSource(inputs, threads);
+	} else if (strcmp(argv[1], "pipeline") == 0) {
+		benchPipeline(inputs, threads);
+	} else if (strcmp(argv[1], "chain") == 0) {
+		benchChain(inputs, threads);
+	} else if (strcmp(argv[1], "poll") == 0) {
+		benchPoll(inputs, threads);
+	} else if (strcmp(argv[1], "cache") == 0) {
+		benchCache(inputs, threads);
+	} else if (strcmp(argv[1], "sink") == 0) {
+		benchSink(inputs, threads);
+	} else if (strcmp(argv[1], "range") == 0) {
+		benchRange(inputs, threads);
+	} else {
+		fprintf(stderr, "unknown mode %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
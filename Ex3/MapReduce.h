@@ -0,0 +1,215 @@
+#ifndef MAPREDUCE_H
+#define MAPREDUCE_H
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "MapReduceFramework.h"
+#include "MapReduceSort.h"
+
+/**
+ * @brief a typed front end of the framework, for keys and values of concrete types
+ * 		  which are stored by value. The mapper and the reducer are function objects
+ * 		  (usually lambdas), and the keys are compared with their own operator<, so
+ * 		  the compiler inlines the map and reduce calls and the comparisons of the
+ * 		  sort and the merge, with no virtual call and no allocation for each pair.
+ *
+ * 		  A job runs in two stages, each one a job of startMapReduceJob (or of a
+ * 		  MapReduceExecutor): the first maps chunks of the input and sorts the pairs
+ * 		  of every chunk, the second merges key ranges of the sorted chunks and
+ * 		  reduces them. The output is sorted by the intermediate keys.
+ *
+ * 		  The mapper is called as mapper(key1, value1, emit2), where emit2(key2, value2)
+ * 		  adds an intermediate pair, and the reducer as reducer(begin, end, emit3) with
+ * 		  the intermediate pairs of one key in [begin, end), where emit3(key3, value3)
+ * 		  adds an output pair. Both are called from several threads at once.
+ */
+template <class Key1, class Value1, class Key2, class Value2, class Key3, class Value3>
+class MapReduce {
+public:
+	typedef std::vector<std::pair<Key1, Value1>> Input;
+	typedef std::pair<Key2, Value2> Pair;
+	typedef std::vector<Pair> Intermediate;
+	typedef std::vector<std::pair<Key3, Value3>> Output;
+
+	/**
+	 * @brief adds the intermediate pairs of a mapper to the sorted chunk it maps.
+	 */
+	class Emit2 {
+	public:
+		explicit Emit2(Intermediate* pairs) : pairs(pairs) { }
+		void operator()(const Key2& key, const Value2& value) { pairs->emplace_back(key, value); }
+	private:
+		Intermediate* pairs;
+	};
+
+	/**
+	 * @brief adds the output pairs of a reducer to the output of its key range.
+	 */
+	class Emit3 {
+	public:
+		explicit Emit3(Output* pairs) : pairs(pairs) { }
+		void operator()(const Key3& key, const Value3& value) { pairs->emplace_back(key, value); }
+	private:
+		Output* pairs;
+	};
+
+	/**
+	 * @brief a front end which runs every stage on multiThreadLevel new threads.
+	 */
+	explicit MapReduce(int multiThreadLevel) : multiThreadLevel(multiThreadLevel), executor(nullptr) { }
+
+	/**
+	 * @brief a front end which runs every stage on the given executor, with
+	 * 		  multiThreadLevel lanes.
+	 */
+	MapReduce(MapReduceExecutor& executor, int multiThreadLevel)
+		: multiThreadLevel(multiThreadLevel), executor(&executor) { }
+
+	/**
+	 * @brief runs a job, and returns once its output pairs were added to output.
+	 */
+	template <class Mapper, class Reducer>
+	void run(const Input& input, Output& output, Mapper mapper, Reducer reducer) const {
+		Job<Mapper, Reducer> job(input, mapper, reducer);
+		const size_t chunks = std::min<size_t>(input.size(), multiThreadLevel * CHUNKS_PER_THREAD);
+		job.chunkSize = (chunks == 0) ? 1 : (input.size() + chunks - 1) / chunks;
+		job.runs.resize(chunks);
+		runStage(job, false, chunks);
+
+		const size_t parts = multiThreadLevel * CHUNKS_PER_THREAD;
+		job.splitParts(parts);
+		job.outputs.resize(parts);
+		runStage(job, true, parts);
+		for (Output& part : job.outputs) {
+			output.insert(output.end(), part.begin(), part.end());
+		}
+	}
+
+private:
+	enum { CHUNKS_PER_THREAD = 4, SAMPLES_PER_CHUNK = 32 };
+
+	// a function object rather than a function, so the helpers of MapReduceSort.h
+	// inline the comparisons
+	struct PairLess {
+		bool operator()(const Pair& p1, const Pair& p2) const { return p1.first < p2.first; }
+	};
+
+	/**
+	 * @brief the state of a running job, shared by its stages.
+	 */
+	template <class Mapper, class Reducer>
+	struct Job {
+		Job(const Input& input, Mapper mapper, Reducer reducer)
+			: input(input), mapper(mapper), reducer(reducer), chunkSize(1) { }
+
+		// maps one chunk of the input, and sorts its pairs
+		void mapChunk(size_t chunk) {
+			Emit2 emit(&(runs[chunk]));
+			const size_t end = std::min(input.size(), (chunk + 1) * chunkSize);
+			for (size_t i = chunk * chunkSize; i < end; ++i) { mapper(input[i].first, input[i].second, emit); }
+			std::sort(runs[chunk].begin(), runs[chunk].end(), PairLess());
+		}
+
+		// splits the sorted chunks into key ranges (parts) of about the same size, by
+		// keys sampled out of the chunks, and finds the range of every part in every
+		// chunk before any part is merged (the merge moves the pairs out of the chunks)
+		void splitParts(size_t parts) {
+			std::vector<const Intermediate*> sorted;
+			for (const Intermediate& run : runs) { sorted.push_back(&run); }
+			Intermediate splitters;
+			sampleSplitters(sorted, parts, SAMPLES_PER_CHUNK, PairLess(), splitters);
+
+			bounds.resize(runs.size());
+			for (size_t r = 0; r < runs.size(); ++r) {
+				for (size_t part = 0; part < parts; ++part) {
+					bounds[r].push_back(partRange(runs[r], splitters, part, PairLess()));
+				}
+			}
+		}
+
+		// merges one key range out of the sorted chunks, and reduces its keys
+		void reducePart(size_t part) {
+			typedef std::move_iterator<typename Intermediate::iterator> Iterator;
+			std::vector<std::pair<Iterator, Iterator>> ranges;
+			for (size_t r = 0; r < runs.size(); ++r) {
+				ranges.emplace_back(Iterator(runs[r].begin() + bounds[r][part].first),
+									Iterator(runs[r].begin() + bounds[r][part].second));
+			}
+			Intermediate merged;
+			mergeRuns(ranges, PairLess(), merged);	// every pair is in one range only
+
+			Emit3 emit(&(outputs[part]));
+			forEachGroup(merged, PairLess(), [&](size_t first, size_t last) {
+				reducer(merged.data() + first, merged.data() + last, emit);
+			});
+		}
+
+		const Input& input;
+		Mapper mapper;
+		Reducer reducer;
+		size_t chunkSize;
+		std::vector<Intermediate> runs;		// the sorted pairs of every input chunk
+		std::vector<std::vector<std::pair<size_t, size_t>>> bounds;	// the range of part i in run r is bounds[r][i]
+		std::vector<Output> outputs;		// the output of every part
+	};
+
+	/**
+	 * @brief a task of a stage, the index of a chunk or of a part. The tasks are the
+	 * 		  input values of the stage jobs.
+	 */
+	struct Task : public V1 {
+		size_t index;
+	};
+
+	/**
+	 * @brief the client of a stage job: every map call runs one task of the stage,
+	 * 		  and emits nothing.
+	 */
+	template <class JobType>
+	class StageClient : public MapReduceClient {
+	public:
+		StageClient(JobType* job, bool reducing) : job(job), reducing(reducing) { }
+
+		void map(const K1* key, const V1* value, void* context) const {
+			const size_t index = static_cast<const Task*>(value)->index;
+			if (reducing) {
+				job->reducePart(index);
+			} else {
+				job->mapChunk(index);
+			}
+		}
+
+		void reduce(const IntermediateVec* pairs, void* context) const { }
+
+	private:
+		JobType* job;
+		bool reducing;
+	};
+
+	/**
+	 * @brief runs the given number of tasks of one stage of the job, and waits for them.
+	 */
+	template <class JobType>
+	void runStage(JobType& job, bool reducing, size_t tasks) const {
+		std::vector<Task> values(tasks);
+		InputVec inputVec;
+		for (size_t i = 0; i < tasks; ++i) {
+			values[i].index = i;
+			inputVec.push_back(InputPair(nullptr, &(values[i])));
+		}
+		StageClient<JobType> client(&job, reducing);
+		OutputVec none;
+		JobHandle handle = (executor != nullptr) ?
+						   executor->submit(client, inputVec, none, multiThreadLevel) :
+						   startMapReduceJob(client, inputVec, none, multiThreadLevel);
+		closeJobHandle(handle);
+	}
+
+	int multiThreadLevel;
+	MapReduceExecutor* executor;
+};
+
+#endif //MAPREDUCE_H
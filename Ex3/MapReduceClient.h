@@ -3,6 +3,9 @@
 
 #include <vector>  //std::vector
 #include <utility> //std::pair
+#include <cstddef> //size_t
+#include <string>  //std::string
+#include <cstdint> //uint32_t
 
 // input key and value.
 // the key, value for the map function and the MapReduceFramework
@@ -26,6 +29,11 @@ public:
 	virtual ~K2(){}
 	virtual bool operator<(const K2 &other) const = 0;
 
+	// optional, used only by clients which group by hash or spill (see
+	// MapReduceClient::groupByHash and spillThreshold). equal keys must have
+	// equal hashes.
+	virtual size_t hash() const { return 0; }
+
 //	virtual void printK2() const;
 //	friend std::ostream& operator<<(std::ostream& os, const K2& k2) {
 //		k2.printK2();
@@ -58,10 +66,23 @@ typedef std::pair<K1*, V1*> InputPair;
 typedef std::pair<K2*, V2*> IntermediatePair;
 typedef std::pair<K3*, V3*> OutputPair;
 
+// a flat intermediate record, emitted by emitRecord: the bytes of a key and of
+// its value, which the framework keeps in its own memory.
+typedef struct {
+	const char* key;
+	const char* value;
+	uint32_t keySize;
+	uint32_t valueSize;
+} IntermediateRecord;
+
 typedef std::vector<InputPair> InputVec;
 typedef std::vector<IntermediatePair> IntermediateVec;
 typedef std::vector<OutputPair> OutputVec;
 
+// the vector which the default reduceRange copies a group into, kept by the
+// framework in the context of the calling thread (defined by the framework).
+IntermediateVec* groupVector(void* context);
+
 
 class MapReduceClient {
 public:
@@ -73,6 +94,96 @@ public:
 	// calls emit3(K3, V3, context) any number of times (usually once)
 	// to output (K3, V3) pairs.
 	virtual void reduce(const IntermediateVec* pairs, void* context) const = 0;
+
+	// same as reduce, for the pairs in [begin, end). the framework keeps the
+	// groups as spans of one shuffled array, and calls this function with them.
+	// the default copies the span into a vector of the calling thread, which is
+	// reused for all the keys of the job (so no vector is allocated for a key),
+	// and calls reduce with it. clients should override it to read the pairs in
+	// place, with no copy ("Benchmark range" measures both).
+	virtual void reduceRange(const IntermediatePair* begin, const IntermediatePair* end,
+							 void* context) const {
+		IntermediateVec* pairs = groupVector(context);
+		pairs->assign(begin, end);
+		reduce(pairs, context);
+		pairs->clear();		// reduce usually deleted the pairs
+	}
+
+	// returns true if the pairs only need to be grouped by key, with no order
+	// between the groups. the framework then partitions the pairs by K2::hash()
+	// already in emit2, instead of sorting them in the shuffle.
+	virtual bool groupByHash() const { return false; }
+
+	// returns true if a client which groups by hash lets the framework pipeline
+	// the phases: the pairs are split into more partitions than threads, every
+	// thread seals its pairs of each partition once it finished mapping (and
+	// combining them), and a partition is grouped and reduced by the first free
+	// thread as soon as all the threads sealed it, with no barrier between the
+	// phases. a large key is then not split (see isReduceAssociative). a job on a
+	// MapReduceExecutor, or on a single thread, runs its phases one after the
+	// other anyway. getJobState reports the shuffle stage from the time every
+	// thread finished mapping (and the sealed partitions are grouped and reduced
+	// already), and the reduce stage once all the partitions were sealed.
+	virtual bool pipelined() const { return false; }
+
+	// returns true if the client implements combine.
+	virtual bool hasCombiner() const { return false; }
+
+	// optional pre-aggregation, run by every mapping thread on its own pairs
+	// before the shuffle. gets the pairs of one key in [begin, end) and calls
+	// emit2(K2, V2, context) to replace them (usually with a single pair), the
+	// emitted pairs must have the same key. like reduce, it should delete the
+	// pairs it gets.
+	virtual void combine(const IntermediatePair* begin, const IntermediatePair* end,
+						 void* context) const { }
+
+	// returns true if reduce is associative, i.e. reducing the combined pairs of
+	// parts of a key gives the same output as reducing all its pairs. the
+	// framework may then split a very large key into parts, combine them in
+	// parallel, and reduce the combined pairs. requires a combiner.
+	virtual bool isReduceAssociative() const { return false; }
+
+	// the most intermediate pairs a thread keeps in memory. once a thread holds
+	// more, it sorts (and combines) them and spills them to a temporary file as
+	// sorted runs, one run for each partition (by K2::hash()), and the reduce
+	// phase streams the groups out of a k-way merge of the runs. 0 (the default)
+	// keeps all the pairs in memory. a client which spills must implement
+	// serializePair, deserializePair and K2::hash().
+	virtual size_t spillThreshold() const { return 0; }
+
+	// appends the bytes of a pair to record. the framework drops the pair after
+	// that, so the client should delete it if it owns it.
+	virtual void serializePair(K2* key, V2* value, std::string& record) const { }
+
+	// creates a pair out of the size bytes written by serializePair. the pair is
+	// given to reduce like the pairs emitted by map.
+	virtual IntermediatePair deserializePair(const char* record, size_t size) const {
+		return IntermediatePair(nullptr, nullptr);
+	}
+
+	// returns true if map emits flat records with emitRecord instead of pairs
+	// with emit2. the records are packed into per thread memory blocks and
+	// sorted by the bytes of their keys (memcmp order, so integers should be
+	// written big endian), with no allocation or virtual call for each pair.
+	// a client which emits records implements reduceRecords instead of reduce,
+	// and groupByHash, combine and spillThreshold are ignored.
+	virtual bool usesRecords() const { return false; }
+
+	// same as reduce, for the records of one key in [begin, end). the bytes of
+	// the records belong to the framework, and are valid until the job is closed.
+	virtual void reduceRecords(const IntermediateRecord* begin, const IntermediateRecord* end,
+							   void* context) const { }
+
+	// used when the client runs a stage of a MapReduceChain: converts an output
+	// pair of the previous stage into an input pair of this stage. the default
+	// casts the key and the value with dynamic_cast, which is enough for types
+	// that derive from both K3 and K1 (V3 and V1). a client which knows the
+	// types may cast them statically, which is much cheaper. the framework
+	// deletes the input pair once the stage finished, so a client which makes
+	// new objects should delete the output pair here.
+	virtual InputPair chainInput(K3* key, V3* value) const {
+		return InputPair(dynamic_cast<K1*>(key), dynamic_cast<V1*>(value));
+	}
 };
 
 
@@ -7,19 +7,43 @@
 
 // ------------------------------ includes ------------------------------------------
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <unistd.h>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
 #include <atomic>
+#include <chrono>
 #include <algorithm>
+#include <unordered_map>
+#include <functional>
+#include <memory>
 #include <vector>
+#include <list>
+#include <deque>
 
 #include "Barrier.h"
 #include "MapReduceFramework.h"
+#include "MapReduceSort.h"
 
 // ------------------------------ macros & constants --------------------------------
 
 #define SHUFFLE_T 0
+#define SAMPLES_PER_THREAD 32	// keys sampled from each sorted vector to choose splitters
+#define CHUNK_TARGET_NS 20000	// the time a thread should spend on one claimed chunk of input
+#define MIN_SPLIT_PAIRS 4096	// smallest group which may be split into sub-reductions
+#define CACHE_LINE 64
+#define LANE_QUANTUM_NS 2000000	// the time an executor thread runs a lane before choosing again
+#define SPILL_BUFFER 65536	// the buffer of a spill file, and of every reader of a spilled run
+#define ARENA_BLOCK (1 << 20)	// the size of the memory blocks of an arena
+#define MAX_SOURCE_CHUNK 4096	// the most pairs a thread reads from an input source at once
+#define SINK_BATCH 256	// the output pairs a thread buffers before it writes them to an output sink
+#define SINK_FLUSH_NS 1000000	// the longest time a thread buffers output for an output sink
+#define PIPELINE_PARTITIONS 4	// the partitions of every thread in a pipelined job
+#define SOURCE_POLL_NS 1000000	// how often an idle executor thread checks the sources not ready
 
 // ------------------------------ GLOBAL VARIABLES -----------------------------------
 
@@ -27,22 +51,167 @@
 
 typedef struct ThreadContext ThreadContext;
 typedef struct JobContext JobContext;
-typedef std::vector<IntermediateVec> ShuffledVec;
+typedef struct ExecutorContext ExecutorContext;
 
 /**
- * A struct includes all parameters which are relevant to a thread
+ * An allocator of memory which starts at a cache line boundary and fills whole
+ * lines, for the arrays of the per thread state which every thread writes on
+ * its own, so they never share a line with memory of another thread.
  */
-struct ThreadContext {
+template <class T>
+struct LineAllocator {
+	typedef T value_type;
+
+	LineAllocator() { }
+	template <class U> LineAllocator(const LineAllocator<U>&) { }
+
+	T* allocate(size_t count) {
+		void* memory;
+		const size_t bytes = (count * sizeof(T) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+		if (posix_memalign(&memory, CACHE_LINE, bytes) != 0) { throw std::bad_alloc(); }
+		return static_cast<T*>(memory);
+	}
+
+	void deallocate(T* memory, size_t count) { free(memory); }
+};
+
+template <class T, class U>
+bool operator==(const LineAllocator<T>&, const LineAllocator<U>&) { return true; }
+
+template <class T, class U>
+bool operator!=(const LineAllocator<T>&, const LineAllocator<U>&) { return false; }
+
+/**
+ * Memory which is allocated from large blocks, and freed all together.
+ */
+struct Arena {
+	std::vector<char*> blocks;
+	char* next = nullptr;
+	size_t left = 0;	// the free bytes after next in the last block
+};
+
+/**
+ * An entry of the index of the records emitted by a thread: the record, and the
+ * first bytes of its key, which are enough to order most records.
+ */
+struct RecordRef {
+	uint64_t prefix;
+	IntermediateRecord record;
+};
+
+/**
+ * A group of all the pairs (or records) of one key, a contiguous span of a
+ * shuffled partition.
+ */
+struct KeyGroup {
+	const IntermediatePair* pairs;
+	const RecordRef* records;	// instead of pairs, in a job which emits records
+	size_t size;
+};
+typedef std::vector<KeyGroup> ShuffledVec;
+
+/**
+ * A group of an associative client which is reduced in parts: each part is
+ * combined separately, and the last part to finish reduces the combined pairs.
+ */
+struct SplitGroup {
+	std::vector<IntermediateVec> partials;
+	std::atomic<size_t> remaining;
+};
+
+/**
+ * A unit of reduce work: a whole group, or one part of a split group.
+ */
+struct ReduceTask {
+	const IntermediatePair* pairs;
+	const RecordRef* records;
+	size_t size;
+	SplitGroup* split;
+	size_t part;
+};
+
+/**
+ * A sorted run of the pairs of one partition, which a thread spilled to its file.
+ */
+struct SpillRun {
+	int fd;
+	uint64_t offset;	// the first byte of the run in the file
+	uint64_t bytes;
+	uint64_t pairs;
+};
+
+/**
+ * A reader of one sorted run in the merge of a spilled partition: a run in a
+ * file, or the pairs of the partition which a thread still held in memory at
+ * the end of the map phase. head is the smallest pair which was not merged yet.
+ */
+struct SpillCursor {
+	int fd;		// -1 for a run in memory
+	uint64_t offset;	// the next byte to read from the file
+	uint64_t last;		// the end of the run in the file
+	uint64_t left;		// the pairs of the run after head
+	std::vector<char> buffer;
+	size_t begin, end;	// the bytes of buffer which were read and not parsed yet
+	const IntermediatePair* next;	// for a run in memory, the pair after head
+	IntermediatePair head;
+};
+
+/**
+ * The progress of one thread in every stage. Each thread writes only its own
+ * counters, which fill a whole cache line, so progress tracking does not share
+ * lines between threads. getJobState sums the counters of all the threads.
+ */
+struct alignas(CACHE_LINE) ThreadProgress {
+	std::atomic<uint64_t> mapped{0};		// input pairs mapped
+	std::atomic<uint64_t> emitted{0};		// intermediate pairs emitted (after combining)
+	std::atomic<uint64_t> shuffled{0};		// intermediate pairs shuffled
+	std::atomic<uint64_t> reduced{0};		// intermediate pairs reduced
+	char padding[CACHE_LINE - 4 * sizeof(std::atomic<uint64_t>)];
+};
+
+/**
+ * A struct includes all parameters which are relevant to a thread. The contexts
+ * of the threads are adjacent, and each thread writes its own context on every
+ * emit, so every context starts at a cache line and fills whole lines.
+ */
+struct alignas(CACHE_LINE) ThreadContext {
 	int threadID;
 	JobContext* jc;
 
 	const MapReduceClient* client;
-	const InputVec* inputVec;
+	const InputVec* inputVec;	// nullptr if the job reads an input source
+	std::vector<InputPair> inputChunk;	// the pairs this thread read from the input source
 	IntermediateVec intermediateVec;
-	OutputVec* outputVec;
+	// in hash mode, the pairs emitted for each partition
+	std::vector<IntermediateVec, LineAllocator<IntermediateVec>> buckets;
+	OutputVec outputBuffer;	// the output of this thread, which was not written to the sink yet
+	std::chrono::steady_clock::time_point lastFlush;	// the last write of outputBuffer to the sink
+	std::vector<size_t> reduceQueue;	// the reduce tasks assigned to this thread, largest first
+	// front (high 32 bits) and back of reduceQueue, written by the threads which
+	// steal tasks too, so it has a cache line of its own
+	alignas(CACHE_LINE) std::atomic<uint64_t> queueRange{0};
+	char queuePadding[CACHE_LINE - sizeof(std::atomic<uint64_t>)];
+	int lanePhase = MAP_STAGE;	// on an executor, the next phase of this lane
+	uint64_t chunk = 1;		// the size of the next input chunk this thread claims
+	bool running = false;		// on an executor, whether an executor thread runs this lane
+
+	// in spill mode, the runs of this thread and the merge of its partition
+	FILE* spillFile = nullptr;
+	uint64_t spillBytes = 0;
+	bool spilling = false;
+	std::vector<std::vector<SpillRun>> spillRuns;	// the runs this thread spilled, by partition
+	std::vector<SpillCursor> cursors;
+	std::vector<SpillCursor*> mergeHeap;
+
+	// the memory of mr_alloc and of the records of this thread, freed with the job
+	Arena arena;
+	// in record mode, the (sorted) index of the records of this thread
+	std::vector<RecordRef> records;
+	std::vector<IntermediateRecord> recordGroup;	// the records of the group being reduced
+	IntermediateVec group;	// the pairs of the group being reduced, see groupVector
 
 	pthread_mutex_t* mutex;
-	std::atomic<uint64_t>* counter;
+	ThreadProgress* progress;
 	Barrier* barrier;
 };
 
@@ -57,49 +226,197 @@ struct JobContext {
 
 	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 	pthread_mutex_t waitJobMutex = PTHREAD_MUTEX_INITIALIZER;
-	std::atomic<uint64_t> counter{0};
+	std::atomic<int> stage{UNDEFINED_STAGE};
+	std::atomic<uint64_t> nextInput{0};	// the next input pair to be claimed by a mapper
+	InputSource* source = nullptr;	// the input source, if there is no input vector
+	pthread_mutex_t sourceMutex = PTHREAD_MUTEX_INITIALIZER;
+	std::atomic<bool> sourceDone{false};
+	uint64_t inputSize = 0;		// the number of input pairs, 0 if the source does not know it
+	OutputSink* sink = nullptr;		// the output sink, a VectorSink for an output vector
+	std::unique_ptr<OutputSink> vectorSink;
+	size_t sinkBatch = SINK_BATCH;	// the output pairs a thread buffers before writing them
+	ThreadProgress* progress;
 	Barrier* barrier;
 
+	int shuffleThread = SHUFFLE_T;
+	bool hashed = false;	// the client groups by hash, see MapReduceClient::groupByHash
+	size_t spillThreshold = 0;	// see MapReduceClient::spillThreshold, 0 if the job does not spill
+	bool records = false;	// the client emits records, see MapReduceClient::usesRecords
+	bool pipelined = false;	// see MapReduceClient::pipelined, only for a job on 2 or more threads of its own
+	std::unique_ptr<std::atomic<size_t>[]> sealed;	// the threads which sealed each partition
+	std::atomic<size_t> nextPartition{0};	// the next partition to be claimed by a reducer
+	pthread_cond_t sealedCond = PTHREAD_COND_INITIALIZER;
 	bool waiting = false;
-	ShuffledVec shuffledVec;
-	uint64_t totalIntermediatePairs;
+	IntermediateVec splitters;		// thread i shuffles the keys in [splitters[i-1], splitters[i])
+	std::vector<RecordRef> recordSplitters;
+	std::vector<std::vector<RecordRef>> recordPartitions;
+	std::vector<IntermediateVec> partitions;	// the pairs shuffled by each thread, grouped by key
+	std::vector<ShuffledVec> partitionGroups;	// the groups of each partition
+	ShuffledVec shuffledVec;	// the groups of all the partitions
+	std::vector<ReduceTask> reduceTasks;
+	std::vector<std::unique_ptr<SplitGroup>> splitGroups;
+	std::atomic<uint64_t> totalIntermediatePairs{0};	// stored before the stage which uses it
+
+	// a job which runs on an executor has lanes instead of threads
+	ExecutorContext* executor = nullptr;
+	JobSchedule schedule = {0, 1};
+	double virtualTime = 0;		// the time the lanes ran, divided by the weight of the job
+	std::atomic<int> openPhase{MAP_STAGE};	// the last phase the lanes may run
+	std::atomic<size_t> arrived{0};		// the lanes which finished the open phase
+	size_t finishedLanes = 0;
+	bool finished = false;
+	pthread_cond_t finishedCond = PTHREAD_COND_INITIALIZER;
+};
+
+/**
+ * The sink of a job with an output vector: the output of every thread is added
+ * to the vector once, when the thread finishes reducing.
+ */
+class VectorSink : public OutputSink {
+public:
+	explicit VectorSink(OutputVec* outputVec) : outputVec(outputVec) { }
+
+	void write(const OutputPair* pairs, size_t count) {
+		outputVec->insert(outputVec->end(), pairs, pairs + count);
+	}
+
+private:
+	OutputVec* outputVec;
+};
+
+/**
+ * A struct which includes all the parameters of an executor, a pool of threads
+ * which runs the lanes of the submitted jobs.
+ * The pointer to this struct is held by MapReduceExecutor.
+ */
+struct ExecutorContext {
+	size_t totalThreads;
+	pthread_t* threads;
+
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+	std::list<JobContext*> jobs;	// the unfinished jobs, oldest first
+	double virtualTime = 0;		// the virtual time of the last job chosen
+	bool sourceWait = false;	// the last search skipped a lane whose input source was not ready
+	bool stopping = false;
 };
 
 // ------------------------------ HELPER FUNCTIONS ----------------------------------
 
 void initJobContext(JobContext* context, const MapReduceClient& client,
-					const InputVec& inputVec, OutputVec& outputVec,
-					int multiThreadLevel);
+					const InputVec* inputVec, InputSource* source,
+					OutputVec* outputVec, OutputSink* sink, int multiThreadLevel);
+JobHandle startJob(const MapReduceClient& client, const InputVec* inputVec, InputSource* source,
+				   OutputVec* outputVec, OutputSink* sink, int multiThreadLevel,
+				   const AffinityPolicy& affinity);
+JobHandle submitJob(ExecutorContext* ec, const MapReduceClient& client, const InputVec* inputVec,
+					InputSource* source, OutputVec* outputVec, OutputSink* sink,
+					int multiThreadLevel, const JobSchedule& schedule);
+void flushOutput(ThreadContext* tc);
 void* threadRoutine(void* arg);
+typedef std::chrono::steady_clock::time_point Deadline;
+bool mapSource(ThreadContext* tc, Deadline deadline);
+bool mapPhase(ThreadContext* tc, Deadline deadline);
+void enterStage(JobContext* jc, int stage);
+void startShuffle(JobContext* jc);
+void shufflePhase(ThreadContext* tc);
+void startReduce(JobContext* jc);
+bool reducePhase(ThreadContext* tc, Deadline deadline);
+void sealPartitions(ThreadContext* tc);
+void reducePartitions(ThreadContext* tc);
+void runLane(ThreadContext* tc);
+ThreadContext* nextLane(ExecutorContext* ec);
+void* executorRoutine(void* arg);
+void addProgress(std::atomic<uint64_t>& counter, int64_t delta);
+uint64_t nextChunkSize(uint64_t chunk, int64_t elapsedNs, uint64_t remaining, size_t threads);
+bool pairLess(const IntermediatePair& p1, const IntermediatePair& p2);
+uint64_t keyPrefix(const char* key, size_t size);
+bool recordLess(const RecordRef& r1, const RecordRef& r2);
+void chooseSplitters(JobContext* jc);
+void shufflePartition(ThreadContext* tc);
+void shuffleRecords(ThreadContext* tc);
+void* arenaAlloc(Arena* arena, size_t size, size_t align);
+void arenaFree(Arena* arena);
+size_t hashPartition(size_t hash, size_t partitions);
+void groupByKey(const std::vector<const IntermediateVec*>& sources, IntermediateVec& pairs,
+				ShuffledVec& groups);
+void groupPartition(ThreadContext* tc);
+void planReduce(JobContext* jc);
+bool popTask(ThreadContext* tc, size_t* task, bool steal);
+void runReduceTask(ThreadContext* tc, size_t task);
+void combinePairs(ThreadContext* tc);
+void combineBucket(ThreadContext* tc, size_t partition);
+void partitionRun(ThreadContext* tc);
+void spillPairs(ThreadContext* tc);
+void openMerge(ThreadContext* tc);
+bool cursorGreater(const SpillCursor* c1, const SpillCursor* c2);
+bool readCursor(const MapReduceClient* client, SpillCursor* cursor);
+void fillCursor(SpillCursor* cursor, size_t bytes);
+bool mergeSpilled(ThreadContext* tc, Deadline deadline);
+int cpuSocket(int cpu);
+void checkAffinity(const AffinityPolicy& affinity);
+std::vector<int> affinityCpus(const AffinityPolicy& affinity, int multiThreadLevel);
+int chooseShuffleThread(const std::vector<int>& cpus);
 void lockMutex(pthread_mutex_t *mutex);
 void unlockMutex(pthread_mutex_t *mutex);
 void freeContext(JobContext* jobContext);
 void destroyMutexes(JobContext* jobContext);
+template <class T> T* newAligned(size_t count);
+template <class T> void deleteAligned(T* objects, size_t count);
 
 // ----------------------------------------------------------------------------------
 /**
  * @brief initializes the JobContext struct
  * @param context The JobContext to be initialized.
- * @param outputVec The output vector.
+ * @param inputVec The input vector, or nullptr if the job reads the input source.
+ * @param source The input source, or nullptr if the job has an input vector.
+ * @param outputVec The output vector, or nullptr if the job writes to the sink.
+ * @param sink The output sink, or nullptr if the job has an output vector.
  * @param multiThreadLevel max number of working threads.
  */
 void initJobContext(JobContext* context, const MapReduceClient& client,
-					const InputVec& inputVec, OutputVec& outputVec,
-					int multiThreadLevel) {
+					const InputVec* inputVec, InputSource* source,
+					OutputVec* outputVec, OutputSink* sink, int multiThreadLevel) {
+	if (outputVec != nullptr) {
+		context->vectorSink.reset(new VectorSink(outputVec));
+		sink = context->vectorSink.get();
+		context->sinkBatch = SIZE_MAX;	// the output vector is written once by every thread
+	}
+	context->sink = sink;
+	context->source = source;
+	context->inputSize = (source != nullptr) ? source->sizeHint() : inputVec->size();
 	context->totalThreads = multiThreadLevel;
-	context->threads = new pthread_t[multiThreadLevel];
-	context->contexts = new ThreadContext[multiThreadLevel];
-	context->barrier = new Barrier(multiThreadLevel);
+	context->threads = nullptr;
+	context->contexts = newAligned<ThreadContext>(multiThreadLevel);
+	context->barrier = nullptr;
+	context->progress = newAligned<ThreadProgress>(multiThreadLevel);
+	// records are always sorted in memory
+	context->records = client.usesRecords();
+	context->spillThreshold = context->records ? 0 : client.spillThreshold();
+	// a spilling job sorts its runs, and partitions them by hash
+	context->hashed = client.groupByHash() && context->spillThreshold == 0 && !context->records;
+	// the lanes of a job on an executor may not wait for each other
+	// a single thread has no other thread to overlap with, pipelining only costs it
+	context->pipelined = context->hashed && client.pipelined() && context->executor == nullptr &&
+						 multiThreadLevel > 1;
+	const size_t partitions = multiThreadLevel * (context->pipelined ? PIPELINE_PARTITIONS : 1);
+	if (context->pipelined) {
+		context->sealed.reset(new std::atomic<size_t>[partitions]);
+		for (size_t p = 0; p < partitions; ++p) { context->sealed[p] = 0; }
+	}
 
 	for (int i = 0; i < multiThreadLevel; ++i) {
 		context->contexts[i].threadID = i;
 		context->contexts[i].jc = context;
 		context->contexts[i].client = &client;
-		context->contexts[i].inputVec = &inputVec;
-		context->contexts[i].outputVec = &outputVec;
+		context->contexts[i].inputVec = inputVec;
+		context->contexts[i].lastFlush = std::chrono::steady_clock::now();
 		context->contexts[i].mutex = &(context->mutex);
-		context->contexts[i].counter = &(context->counter);
-		context->contexts[i].barrier = context->barrier;
+		context->contexts[i].progress = context->progress + i;
+		if (context->hashed || context->spillThreshold > 0) {
+			context->contexts[i].buckets.resize(partitions);
+		}
+		if (context->spillThreshold > 0) { context->contexts[i].spillRuns.resize(multiThreadLevel); }
 	}
 }
 
@@ -112,68 +429,1059 @@ void* threadRoutine(void* arg) {
 	auto tc =  static_cast<ThreadContext*>(arg);
 
 	// (1) The MAP phase
-	if ((*(tc->counter)) >> 62 != 1) { (*(tc->counter)) = (uint64_t) 1 << 62; }
-	uint64_t inputElements = (*(tc->inputVec)).size();
-	uint64_t oldValue = (*(tc->counter))++;
-	while((oldValue & (0x7FFFFFFF)) < inputElements) {
-		InputPair inputPair = (*(tc->inputVec))[oldValue & (0x7FFFFFFF)];
-		tc->client->map(inputPair.first, inputPair.second, tc);
-		oldValue = (*(tc->counter))++;
+	mapPhase(tc, Deadline::max());
+	if (tc->jc->pipelined) {
+		// (2) + (3) every partition is shuffled and reduced once all the threads sealed it
+		sealPartitions(tc);
+		reducePartitions(tc);
+		return nullptr;
 	}
 	tc->barrier->barrier();
 
-	// (2) The SORT & SHUFFLE phase
-	if (tc->threadID == SHUFFLE_T) {
-		lockMutex(tc->mutex);
-		tc->jc->totalIntermediatePairs = (*(tc->counter))>>31 & (0x7FFFFFFF);
-		(*(tc->counter)) = (uint64_t) 2 << 62;
-
-		IntermediateVec allPairs;
-		for (size_t i = 0; i < tc->jc->totalThreads; ++i) {
-			while (!tc->jc->contexts[i].intermediateVec.empty()) {
-				IntermediatePair pair = tc->jc->contexts[i].intermediateVec.back();
-				tc->jc->contexts[i].intermediateVec.pop_back();
-				allPairs.push_back(pair);
+	// (2) The SHUFFLE phase, every thread merges one key range of all the sorted vectors
+	if (tc->threadID == tc->jc->shuffleThread) { startShuffle(tc->jc); }
+	tc->barrier->barrier();
+	shufflePhase(tc);
+	tc->barrier->barrier();
+	if (tc->threadID == tc->jc->shuffleThread) { startReduce(tc->jc); }
+	tc->barrier->barrier();
+
+	// (3) The REDUCE phase
+	reducePhase(tc, Deadline::max());
+	return nullptr;
+}
+
+/**
+ * @brief maps chunks of the input until it is all claimed, then sorts (and
+ * 		  combines) the pairs this thread emitted.
+ * @param deadline the thread stops claiming chunks at this time.
+ * @return true if the input is all claimed, false if the deadline passed first.
+ */
+bool mapPhase(ThreadContext* tc, Deadline deadline) {
+	if (tc->jc->stage != MAP_STAGE) { tc->jc->stage = MAP_STAGE; }
+	if (tc->jc->source != nullptr) {
+		if (!mapSource(tc, deadline)) { return false; }
+	} else {
+		uint64_t inputElements = (*(tc->inputVec)).size();
+		// the input is claimed in chunks, one atomic add for a whole chunk
+		uint64_t& chunk = tc->chunk;
+		while (true) {
+			if (std::chrono::steady_clock::now() >= deadline) { return false; }
+			const uint64_t first = tc->jc->nextInput.fetch_add(chunk);
+			if (first >= inputElements) { break; }
+			const uint64_t last = std::min(first + chunk, inputElements);
+			auto start = std::chrono::steady_clock::now();
+			for (uint64_t i = first; i < last; ++i) {
+				const InputPair& inputPair = (*(tc->inputVec))[i];
+				tc->client->map(inputPair.first, inputPair.second, tc);
 			}
+			addProgress(tc->progress->mapped, last - first);
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			chunk = nextChunkSize(chunk, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+								  inputElements - last, tc->jc->totalThreads);
+		}
+	}
+	if (tc->jc->records) {
+		std::sort(tc->records.begin(), tc->records.end(), recordLess);
+		return true;
+	}
+	if (tc->jc->spillThreshold > 0) {
+		// the pairs left in memory become the last run of this thread, and the
+		// spilled runs are flushed for the other threads to read
+		partitionRun(tc);
+		if (tc->spillFile != nullptr && fflush(tc->spillFile) != 0) {
+			fprintf(stderr, "system error: error on fflush\n");
+			exit(EXIT_FAILURE);
+		}
+		return true;
+	}
+	// each thread sorts its own intermediate vector, so the shuffle only merges
+	if (!tc->jc->hashed) {
+		std::sort(tc->intermediateVec.begin(), tc->intermediateVec.end(), pairLess);
+	}
+	// a pipelined job combines every partition right before sealing it
+	if (tc->client->hasCombiner() && !tc->jc->pipelined) { combinePairs(tc); }
+	return true;
+}
+
+/**
+ * @brief maps chunks read from the input source of the job until it ends. The
+ * 		  reads are serialized by the source mutex, and every chunk is released to
+ * 		  the source as soon as it is mapped, so the input is never all in memory.
+ * 		  While the source is not ready, a lane on an executor returns, and a thread
+ * 		  of the job yields.
+ * @param deadline the thread stops reading chunks at this time.
+ * @return true if the source ended, false if the deadline passed first, or the
+ * 		   source was not ready on an executor.
+ */
+bool mapSource(ThreadContext* tc, Deadline deadline) {
+	JobContext* jc = tc->jc;
+	uint64_t& chunk = tc->chunk;
+	std::vector<InputPair>& pairs = tc->inputChunk;
+	while (!jc->sourceDone) {
+		if (std::chrono::steady_clock::now() >= deadline) { return false; }
+		pairs.resize(chunk);
+		lockMutex(&(jc->sourceMutex));
+		if (!jc->sourceDone && !jc->source->ready()) {
+			unlockMutex(&(jc->sourceMutex));
+			if (jc->executor != nullptr) { return false; }
+			sched_yield();
+			continue;
+		}
+		const size_t count = jc->sourceDone ? 0 : jc->source->read(pairs.data(), chunk);
+		if (count == 0) { jc->sourceDone = true; }
+		unlockMutex(&(jc->sourceMutex));
+		if (count == 0) { break; }
+
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < count; ++i) { tc->client->map(pairs[i].first, pairs[i].second, tc); }
+		jc->source->release(pairs.data(), count);
+		addProgress(tc->progress->mapped, count);
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		chunk = std::min<uint64_t>(MAX_SOURCE_CHUNK, nextChunkSize(chunk,
+				std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), UINT64_MAX,
+				jc->totalThreads));
+	}
+	return true;
+}
+
+/**
+ * @brief counts the intermediate pairs once all the threads finished emitting, and
+ * 		  moves the job to the given stage. The total is stored before the stage, so
+ * 		  getJobState, which reads the stage first and takes no lock, never sees the
+ * 		  new stage with the total of the old one.
+ */
+void enterStage(JobContext* jc, int stage) {
+	uint64_t total = 0;
+	for (size_t i = 0; i < jc->totalThreads; ++i) { total += jc->progress[i].emitted; }
+	jc->totalIntermediatePairs.store(total, std::memory_order_release);
+	jc->stage.store(stage, std::memory_order_release);
+}
+
+/**
+ * @brief the step between the map and the shuffle phases, run by one thread once
+ * 		  all the threads finished mapping: counts the intermediate pairs and
+ * 		  divides them into the partitions of the threads.
+ */
+void startShuffle(JobContext* jc) {
+	enterStage(jc, SHUFFLE_STAGE);
+	if (jc->spillThreshold > 0) {
+		return;		// the runs are already partitioned
+	} else if (jc->hashed) {
+		jc->partitions.resize(jc->totalThreads);
+		jc->partitionGroups.resize(jc->totalThreads);
+	} else {
+		chooseSplitters(jc);
+	}
+}
+
+/**
+ * @brief shuffles the partition of this thread.
+ */
+void shufflePhase(ThreadContext* tc) {
+	if (tc->jc->records) {
+		shuffleRecords(tc);
+	} else if (tc->jc->spillThreshold > 0) {
+		openMerge(tc);
+	} else if (tc->jc->hashed) {
+		groupPartition(tc);
+	} else {
+		shufflePartition(tc);
+	}
+}
+
+/**
+ * @brief the step between the shuffle and the reduce phases, run by one thread once
+ * 		  all the threads finished shuffling: gathers the groups of all the
+ * 		  partitions and assigns them to the reduce queues of the threads.
+ */
+void startReduce(JobContext* jc) {
+	if (jc->spillThreshold > 0) {
+		jc->stage = REDUCE_STAGE;	// every thread reduces the merge of its partition
+		return;
+	}
+	for (size_t i = 0; i < jc->totalThreads; ++i) {
+		jc->contexts[i].intermediateVec.clear();
+		for (auto &bucket : jc->contexts[i].buckets) { bucket.clear(); }
+		std::vector<RecordRef>().swap(jc->contexts[i].records);	// the partitions hold the records now
+	}
+	for (auto &groups : jc->partitionGroups) {
+		jc->shuffledVec.insert(jc->shuffledVec.end(), groups.begin(), groups.end());
+		groups.clear();
+	}
+	planReduce(jc);
+	jc->stage = REDUCE_STAGE;
+}
+
+/**
+ * @brief reduces the own tasks of this thread first, then tasks stolen from the
+ * 		  other threads, and adds the output of this thread to the job output.
+ * @param deadline the thread stops taking tasks at this time.
+ * @return true if no task is left, false if the deadline passed first.
+ */
+bool reducePhase(ThreadContext* tc, Deadline deadline) {
+	if (tc->jc->spillThreshold > 0 && !mergeSpilled(tc, deadline)) { return false; }
+	size_t task;
+	for (size_t i = 0; i < tc->jc->totalThreads; ++i) {
+		ThreadContext* victim = tc->jc->contexts + (tc->threadID + i) % tc->jc->totalThreads;
+		while (true) {
+			if (std::chrono::steady_clock::now() >= deadline) { return false; }
+			if (!popTask(victim, &task, i > 0)) { break; }
+			runReduceTask(tc, task);
 		}
+	}
+
+	flushOutput(tc);
+	tc->outputBuffer.shrink_to_fit();
+	return true;
+}
 
-		// sorting the allPairs vector
-		std::sort(allPairs.begin(), allPairs.end(),
-				  [](IntermediatePair p1, IntermediatePair p2) { return *(p1.first) < *(p2.first); });
-
-		while (!allPairs.empty()) {
-			IntermediateVec uniKeyVec;
-			IntermediatePair uniPair = allPairs.back();
-			while (!(*(uniPair.first) < *(allPairs.back().first)) &&
-				   !(*(allPairs.back().first) < *(uniPair.first))) {
-				IntermediatePair pair = allPairs.back();
-				allPairs.pop_back();
-				uniKeyVec.push_back(pair);
-				/* update the number of already processed keys */
-				(*(tc->counter)) += (uint64_t) 1 << 31;
-				if  (allPairs.empty()) { break; }
+/**
+ * @brief seals the pairs this thread emitted into every partition of a pipelined
+ * 		  job (after combining them), in the order of the partitions, so the first
+ * 		  partitions are ready while this thread still combines the last ones. The
+ * 		  thread which seals the first partition last starts the shuffle stage (all
+ * 		  the threads finished mapping), and the one which seals the last partition
+ * 		  last starts the reduce stage.
+ */
+void sealPartitions(ThreadContext* tc) {
+	JobContext* jc = tc->jc;
+	for (size_t p = 0; p < tc->buckets.size(); ++p) {
+		if (tc->client->hasCombiner()) { combineBucket(tc, p); }
+		if (++(jc->sealed[p]) < jc->totalThreads) { continue; }
+		// every thread finished mapping once the first partition is sealed, and
+		// combining (so the emitted counters are final) once the last one is
+		if (p == 0) { enterStage(jc, SHUFFLE_STAGE); }
+		if (p + 1 == tc->buckets.size()) { enterStage(jc, REDUCE_STAGE); }
+		lockMutex(&(jc->mutex));
+		pthread_cond_broadcast(&(jc->sealedCond));
+		unlockMutex(&(jc->mutex));
+	}
+}
+
+/**
+ * @brief the shuffle and reduce phases of a pipelined job: claims the partitions
+ * 		  one after the other, waits until every thread sealed the claimed one, then
+ * 		  groups its pairs by key and reduces them. A thread which finishes its
+ * 		  partitions early claims more of them, so no thread waits for a barrier.
+ */
+void reducePartitions(ThreadContext* tc) {
+	JobContext* jc = tc->jc;
+	const size_t partitions = tc->buckets.size();
+	size_t p;
+	while ((p = jc->nextPartition++) < partitions) {
+		lockMutex(&(jc->mutex));
+		while (jc->sealed[p] < jc->totalThreads) {
+			if (pthread_cond_wait(&(jc->sealedCond), &(jc->mutex)) != 0) {
+				fprintf(stderr, "system error: error on pthread_cond_wait\n");
+				exit(EXIT_FAILURE);
 			}
-			tc->jc->shuffledVec.push_back(uniKeyVec);
 		}
+		unlockMutex(&(jc->mutex));
+
+		std::vector<const IntermediateVec*> buckets;
+		for (size_t i = 0; i < jc->totalThreads; ++i) { buckets.push_back(&(jc->contexts[i].buckets[p])); }
+		IntermediateVec pairs;
+		ShuffledVec groups;
+		groupByKey(buckets, pairs, groups);
+		// the sealed buckets are not touched by their threads anymore
+		for (size_t i = 0; i < jc->totalThreads; ++i) { IntermediateVec().swap(jc->contexts[i].buckets[p]); }
+		addProgress(tc->progress->shuffled, pairs.size());
+
+		for (const KeyGroup& group : groups) {
+			tc->client->reduceRange(group.pairs, group.pairs + group.size, tc);
+			addProgress(tc->progress->reduced, group.size);
+		}
+	}
+
+	flushOutput(tc);
+	tc->outputBuffer.shrink_to_fit();
+}
 
-		(*(tc->counter)) = (uint64_t) 3 << 62;
+/**
+ * @brief writes the output pairs buffered by this thread to the output sink of
+ * 		  the job. The writes of all the threads are serialized by the job mutex.
+ */
+void flushOutput(ThreadContext* tc) {
+	if (!tc->outputBuffer.empty()) {
+		lockMutex(tc->mutex);
+		tc->jc->sink->write(tc->outputBuffer.data(), tc->outputBuffer.size());
 		unlockMutex(tc->mutex);
+		tc->outputBuffer.clear();
 	}
-	tc->barrier->barrier();
+	tc->lastFlush = std::chrono::steady_clock::now();
+}
 
-	// (3) The REDUCE phase
-	uint64_t shuffled = tc->jc->shuffledVec.size();
-	oldValue = (*(tc->counter))++;
-	while((oldValue & (0x7FFFFFFF)) < shuffled) {
-		IntermediateVec intermediateVec = tc->jc->shuffledVec[oldValue & (0x7FFFFFFF)];
-		tc->client->reduce(&intermediateVec, tc);
-		(*(tc->counter)) += (uint64_t) intermediateVec.size() << 31;
-		oldValue = (*(tc->counter))++;
+/**
+ * @brief runs the next phase of one lane of a job which runs on an executor, for
+ * 		  about one quantum: the map and the reduce phases stop at the end of the
+ * 		  quantum and resume at the next run of the lane, so a long job does not hold
+ * 		  an executor thread. There is no barrier between the phases: the last lane
+ * 		  to finish a phase runs the step between the phases, and then opens the next
+ * 		  phase to all the lanes.
+ */
+void runLane(ThreadContext* tc) {
+	JobContext* jc = tc->jc;
+	const int phase = tc->lanePhase;
+	const Deadline deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(LANE_QUANTUM_NS);
+	bool finished = true;
+	switch (phase) {
+		case MAP_STAGE:
+			finished = mapPhase(tc, deadline);
+			break;
+		case SHUFFLE_STAGE:
+			shufflePhase(tc);
+			break;
+		default:
+			finished = reducePhase(tc, deadline);
 	}
+	if (!finished) { return; }
+	tc->lanePhase++;
+	if (++(jc->arrived) == jc->totalThreads) {
+		jc->arrived = 0;
+		if (phase == MAP_STAGE) {
+			startShuffle(jc);
+		} else if (phase == SHUFFLE_STAGE) {
+			startReduce(jc);
+		}
+		jc->openPhase = phase + 1;
+	}
+}
 
+/**
+ * @brief finds a lane which may run now, that is not running and whose next phase
+ * 		  is open (and whose input source is ready, for a mapping lane). The lane
+ * 		  is taken from the job of the highest priority, and among the jobs of
+ * 		  that priority from the job of the smallest virtual time (the time its
+ * 		  lanes ran divided by its weight), so the executor threads are shared
+ * 		  between the jobs in proportion to their weights.
+ * 		  Called with the executor mutex.
+ * @return the lane, or nullptr if there is none.
+ */
+ThreadContext* nextLane(ExecutorContext* ec) {
+	ec->sourceWait = false;
+	JobContext* best = nullptr;
+	ThreadContext* lane = nullptr;
+	for (JobContext* jc : ec->jobs) {
+		if (best != nullptr && (jc->schedule.priority < best->schedule.priority ||
+			(jc->schedule.priority == best->schedule.priority && jc->virtualTime >= best->virtualTime))) {
+			continue;
+		}
+		const int open = jc->openPhase;
+		for (size_t i = 0; i < jc->totalThreads; ++i) {
+			ThreadContext* tc = jc->contexts + i;
+			if (!tc->running && tc->lanePhase == MAP_STAGE && jc->source != nullptr &&
+				!jc->sourceDone && !jc->source->ready()) {
+				ec->sourceWait = true;
+				continue;
+			}
+			if (!tc->running && tc->lanePhase <= open && tc->lanePhase <= REDUCE_STAGE) {
+				best = jc;
+				lane = tc;
+				break;
+			}
+		}
+	}
+	if (best != nullptr) { ec->virtualTime = best->virtualTime; }
+	return lane;
+}
+
+/**
+ * @brief The start routine of the executor threads: runs lanes of the submitted
+ * 		  jobs until the executor is destroyed and all its jobs are finished.
+ */
+void* executorRoutine(void* arg) {
+	auto ec = static_cast<ExecutorContext*>(arg);
+	lockMutex(&(ec->mutex));
+	while (true) {
+		ThreadContext* tc = nextLane(ec);
+		if (tc == nullptr) {
+			if (ec->stopping && ec->jobs.empty()) { break; }
+			if (ec->sourceWait) {
+				// nothing wakes the thread when a source gets ready, so it checks again soon
+				timespec wake;
+				clock_gettime(CLOCK_REALTIME, &wake);
+				wake.tv_nsec += SOURCE_POLL_NS;
+				if (wake.tv_nsec >= 1000000000) {
+					wake.tv_sec++;
+					wake.tv_nsec -= 1000000000;
+				}
+				const int error = pthread_cond_timedwait(&(ec->workReady), &(ec->mutex), &wake);
+				if (error != 0 && error != ETIMEDOUT) {
+					fprintf(stderr, "system error: error on pthread_cond_timedwait\n");
+					exit(EXIT_FAILURE);
+				}
+			} else if (pthread_cond_wait(&(ec->workReady), &(ec->mutex)) != 0) {
+				fprintf(stderr, "system error: error on pthread_cond_wait\n");
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+		tc->running = true;
+		unlockMutex(&(ec->mutex));
+		auto start = std::chrono::steady_clock::now();
+		runLane(tc);
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		lockMutex(&(ec->mutex));
+		tc->running = false;
+
+		JobContext* jc = tc->jc;
+		jc->virtualTime += (double) std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+						   jc->schedule.weight;
+		if (tc->lanePhase > REDUCE_STAGE && ++(jc->finishedLanes) == jc->totalThreads) {
+			ec->jobs.erase(std::find(ec->jobs.begin(), ec->jobs.end(), jc));
+			lockMutex(&(jc->waitJobMutex));
+			jc->finished = true;
+			pthread_cond_broadcast(&(jc->finishedCond));
+			unlockMutex(&(jc->waitJobMutex));
+		}
+		// a finished phase may have opened the next one to other lanes
+		pthread_cond_broadcast(&(ec->workReady));
+	}
+	unlockMutex(&(ec->mutex));
 	return nullptr;
 }
 
+/**
+ * @brief adds delta to a progress counter of the calling thread. Only the owner
+ * 		  thread writes its counters, so a plain load and store are enough (no
+ * 		  locked instruction), and readers always see a whole value.
+ */
+void addProgress(std::atomic<uint64_t>& counter, int64_t delta) {
+	counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+/**
+ * @brief adapts the size of the next input chunk of a thread to the cost of the
+ * 		  items, so a chunk takes about CHUNK_TARGET_NS: cheap items are claimed
+ * 		  many at a time, and expensive ones one by one. The chunk is also capped by
+ * 		  a share of the remaining input (guided scheduling), so the threads finish
+ * 		  together.
+ */
+uint64_t nextChunkSize(uint64_t chunk, int64_t elapsedNs, uint64_t remaining, size_t threads) {
+	if (elapsedNs < CHUNK_TARGET_NS / 2) {
+		chunk *= 2;
+	} else if (elapsedNs > CHUNK_TARGET_NS * 2 && chunk > 1) {
+		chunk /= 2;
+	}
+	return std::max<uint64_t>(1, std::min<uint64_t>(chunk, remaining / (2 * threads)));
+}
+
+/**
+ * @brief orders intermediate pairs by their keys.
+ */
+bool pairLess(const IntermediatePair& p1, const IntermediatePair& p2) {
+	return *(p1.first) < *(p2.first);
+}
+
+/**
+ * @brief returns the first 8 bytes of a key as a big endian number (padded with
+ * 		  zeros), so comparing prefixes compares the first bytes of the keys.
+ */
+uint64_t keyPrefix(const char* key, size_t size) {
+	uint64_t prefix = 0;
+	for (size_t i = 0; i < sizeof(prefix); ++i) {
+		prefix = (prefix << 8) | (i < size ? (unsigned char) key[i] : 0);
+	}
+	return prefix;
+}
+
+/**
+ * @brief orders records by the bytes of their keys (a shorter key first if it is a
+ * 		  prefix of the other). The prefixes are compared first, so most comparisons
+ * 		  do not read the keys.
+ */
+bool recordLess(const RecordRef& r1, const RecordRef& r2) {
+	if (r1.prefix != r2.prefix) { return r1.prefix < r2.prefix; }
+	const int order = memcmp(r1.record.key, r2.record.key, std::min(r1.record.keySize, r2.record.keySize));
+	return order < 0 || (order == 0 && r1.record.keySize < r2.record.keySize);
+}
+
+/**
+ * @brief chooses the splitters of the key ranges of the threads, out of the sorted
+ * 		  intermediate vectors (or record indexes) of all the threads.
+ */
+void chooseSplitters(JobContext* jc) {
+	if (jc->records) {
+		std::vector<const std::vector<RecordRef>*> sorted;
+		for (size_t i = 0; i < jc->totalThreads; ++i) { sorted.push_back(&(jc->contexts[i].records)); }
+		sampleSplitters(sorted, jc->totalThreads, SAMPLES_PER_THREAD, recordLess, jc->recordSplitters);
+		jc->recordPartitions.resize(jc->totalThreads);
+	} else {
+		std::vector<const IntermediateVec*> sorted;
+		for (size_t i = 0; i < jc->totalThreads; ++i) { sorted.push_back(&(jc->contexts[i].intermediateVec)); }
+		sampleSplitters(sorted, jc->totalThreads, SAMPLES_PER_THREAD, pairLess, jc->splitters);
+		jc->partitions.resize(jc->totalThreads);
+	}
+	jc->partitionGroups.resize(jc->totalThreads);
+}
+
+/**
+ * @brief merges the key range of this thread out of every sorted intermediate
+ * 		  vector into its partition, which is the only copy of the pairs, and
+ * 		  records the span of every key in the partition.
+ */
+void shufflePartition(ThreadContext* tc) {
+	JobContext* jc = tc->jc;
+	const size_t id = tc->threadID;
+	std::vector<const IntermediateVec*> sorted;
+	for (size_t i = 0; i < jc->totalThreads; ++i) { sorted.push_back(&(jc->contexts[i].intermediateVec)); }
+	IntermediateVec& merged = jc->partitions[id];
+	mergeRange(sorted, jc->splitters, id, pairLess, merged);
+
+	// split the merged pairs into spans of equal keys
+	ShuffledVec& groups = jc->partitionGroups[id];
+	forEachGroup(merged, pairLess, [&](size_t first, size_t last) {
+		groups.push_back({merged.data() + first, nullptr, last - first});
+		/* update the number of already processed keys */
+		addProgress(tc->progress->shuffled, last - first);
+	});
+}
+
+/**
+ * @brief same as shufflePartition, for the record indexes of a job which emits
+ * 		  records.
+ */
+void shuffleRecords(ThreadContext* tc) {
+	JobContext* jc = tc->jc;
+	const size_t id = tc->threadID;
+	std::vector<const std::vector<RecordRef>*> sorted;
+	for (size_t i = 0; i < jc->totalThreads; ++i) { sorted.push_back(&(jc->contexts[i].records)); }
+	std::vector<RecordRef>& merged = jc->recordPartitions[id];
+	mergeRange(sorted, jc->recordSplitters, id, recordLess, merged);
+
+	ShuffledVec& groups = jc->partitionGroups[id];
+	forEachGroup(merged, recordLess, [&](size_t first, size_t last) {
+		groups.push_back({nullptr, merged.data() + first, last - first});
+		/* update the number of already processed keys */
+		addProgress(tc->progress->shuffled, last - first);
+	});
+}
+
+/**
+ * @brief maps a key hash to a partition, mixing the bits first so that weak
+ * 		  hashes (e.g. the identity) are spread over all the partitions.
+ */
+size_t hashPartition(size_t hash, size_t partitions) {
+	return (size_t) (((uint64_t) hash * 0x9E3779B97F4A7C15ULL) >> 32) % partitions;
+}
+
+/**
+ * @brief groups the pairs of the sources by key, using a hash table, in expected
+ * 		  linear time. The pairs are copied once, into the span of their group in
+ * 		  pairs (counting sort), and the spans are added to groups.
+ */
+void groupByKey(const std::vector<const IntermediateVec*>& sources, IntermediateVec& pairs,
+				ShuffledVec& groups) {
+	auto keyHash = [](const K2* key) { return key->hash(); };
+	auto keyEqual = [](const K2* k1, const K2* k2) { return !(*k1 < *k2) && !(*k2 < *k1); };
+
+	size_t total = 0;
+	for (auto source : sources) { total += source->size(); }
+	std::unordered_map<const K2*, size_t, decltype(keyHash), decltype(keyEqual)>
+		groupIndex(total, keyHash, keyEqual);
+
+	// (I) find the group of every pair, and the size of every group
+	std::vector<size_t> groupOf;
+	std::vector<size_t> offsets;
+	groupOf.reserve(total);
+	for (auto source : sources) {
+		for (const IntermediatePair& pair : *source) {
+			auto inserted = groupIndex.emplace(pair.first, offsets.size());
+			if (inserted.second) { offsets.push_back(0); }
+			++offsets[inserted.first->second];
+			groupOf.push_back(inserted.first->second);
+		}
+	}
+
+	// (II) place every pair in the span of its group
+	pairs.resize(total);
+	size_t begin = 0;
+	for (size_t &offset : offsets) {
+		const size_t size = offset;
+		groups.push_back({pairs.data() + begin, nullptr, size});
+		offset = begin;		// from now on, the next free position in the group
+		begin += size;
+	}
+	size_t k = 0;
+	for (auto source : sources) {
+		for (const IntermediatePair& pair : *source) {
+			pairs[offsets[groupOf[k++]]++] = pair;
+		}
+	}
+}
+
+/**
+ * @brief groups by key the pairs which every thread emitted into the bucket of
+ * 		  this thread, into the partition of this thread.
+ */
+void groupPartition(ThreadContext* tc) {
+	JobContext* jc = tc->jc;
+	const size_t id = tc->threadID;
+	std::vector<const IntermediateVec*> buckets;
+	for (size_t i = 0; i < jc->totalThreads; ++i) { buckets.push_back(&(jc->contexts[i].buckets[id])); }
+	groupByKey(buckets, jc->partitions[id], jc->partitionGroups[id]);
+	/* update the number of already processed keys */
+	addProgress(tc->progress->shuffled, jc->partitions[id].size());
+}
+
+/**
+ * @brief runs the client combiner on every key of the pairs this thread emitted.
+ * 		  The pairs are taken out of the thread vectors first, so the pairs the
+ * 		  combiner emits replace them. In sort mode the vector is sorted, so its
+ * 		  groups are already contiguous, and the combined pairs stay sorted.
+ */
+void combinePairs(ThreadContext* tc) {
+	if (tc->jc->hashed) {
+		for (size_t p = 0; p < tc->buckets.size(); ++p) { combineBucket(tc, p); }
+		return;
+	}
+	IntermediateVec emitted;
+	emitted.swap(tc->intermediateVec);
+	forEachGroup(emitted, pairLess, [&](size_t first, size_t last) {
+		tc->client->combine(emitted.data() + first, emitted.data() + last, tc);
+	});
+	if (!std::is_sorted(tc->intermediateVec.begin(), tc->intermediateVec.end(), pairLess)) {
+		std::sort(tc->intermediateVec.begin(), tc->intermediateVec.end(), pairLess);
+	}
+	// the combined pairs were counted by emit2, and replaced by the pairs emitted now
+	addProgress(tc->progress->emitted, -(int64_t) emitted.size());
+}
+
+/**
+ * @brief runs the client combiner on every key of the pairs this thread emitted
+ * 		  into one partition (in hash mode). The combined pairs have the same keys,
+ * 		  so emit2 puts them back into the same bucket.
+ */
+void combineBucket(ThreadContext* tc, size_t partition) {
+	IntermediateVec emitted, pairs;
+	ShuffledVec groups;
+	emitted.swap(tc->buckets[partition]);
+	groupByKey(std::vector<const IntermediateVec*>{&emitted}, pairs, groups);
+	for (const KeyGroup& group : groups) {
+		tc->client->combine(group.pairs, group.pairs + group.size, tc);
+	}
+	addProgress(tc->progress->emitted, -(int64_t) emitted.size());
+}
+
+/**
+ * @brief sorts (and combines) the pairs this thread holds in memory, and moves
+ * 		  them to the buckets of their partitions, where they stay sorted.
+ */
+void partitionRun(ThreadContext* tc) {
+	tc->spilling = true;	// the combiner emits into intermediateVec, which is not spilled now
+	std::sort(tc->intermediateVec.begin(), tc->intermediateVec.end(), pairLess);
+	if (tc->client->hasCombiner()) { combinePairs(tc); }
+	for (const IntermediatePair& pair : tc->intermediateVec) {
+		tc->buckets[hashPartition(pair.first->hash(), tc->buckets.size())].push_back(pair);
+	}
+	tc->intermediateVec.clear();
+	tc->spilling = false;
+}
+
+/**
+ * @brief writes the pairs this thread holds in memory to its spill file, as one
+ * 		  sorted run for each partition. Every pair is a record of its size (4
+ * 		  bytes) followed by the bytes written by the client serializer.
+ */
+void spillPairs(ThreadContext* tc) {
+	partitionRun(tc);
+	if (tc->spillFile == nullptr) {
+		tc->spillFile = tmpfile();
+		if (tc->spillFile == nullptr || setvbuf(tc->spillFile, nullptr, _IOFBF, SPILL_BUFFER) != 0) {
+			fprintf(stderr, "system error: error on tmpfile\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	std::string record;
+	for (size_t p = 0; p < tc->buckets.size(); ++p) {
+		IntermediateVec& bucket = tc->buckets[p];
+		if (bucket.empty()) { continue; }
+		SpillRun run = {fileno(tc->spillFile), tc->spillBytes, 0, bucket.size()};
+		for (const IntermediatePair& pair : bucket) {
+			record.clear();
+			tc->client->serializePair(pair.first, pair.second, record);
+			const uint32_t size = record.size();
+			if (fwrite(&size, sizeof(size), 1, tc->spillFile) != 1 ||
+				fwrite(record.data(), 1, size, tc->spillFile) != size) {
+				fprintf(stderr, "system error: error on fwrite\n");
+				exit(EXIT_FAILURE);
+			}
+			tc->spillBytes += sizeof(size) + size;
+		}
+		run.bytes = tc->spillBytes - run.offset;
+		tc->spillRuns[p].push_back(run);
+		bucket.clear();
+		bucket.shrink_to_fit();
+	}
+}
+
+/**
+ * @brief opens the merge of the partition of this thread: a reader of every run
+ * 		  of the partition, spilled or in memory, ordered in a heap by their heads.
+ */
+void openMerge(ThreadContext* tc) {
+	JobContext* jc = tc->jc;
+	const size_t id = tc->threadID;
+	uint64_t total = 0;
+	for (size_t i = 0; i < jc->totalThreads; ++i) {
+		for (const SpillRun& run : jc->contexts[i].spillRuns[id]) {
+			// a short run gets a short buffer, so many small runs fit in memory
+			std::vector<char> buffer(std::min<uint64_t>(SPILL_BUFFER, run.bytes));
+			tc->cursors.push_back({run.fd, run.offset, run.offset + run.bytes, run.pairs, buffer,
+								   0, 0, nullptr, IntermediatePair()});
+			total += run.pairs;
+		}
+		const IntermediateVec& bucket = jc->contexts[i].buckets[id];
+		if (!bucket.empty()) {
+			tc->cursors.push_back({-1, 0, 0, bucket.size(), std::vector<char>(), 0, 0, bucket.data(),
+								   IntermediatePair()});
+			total += bucket.size();
+		}
+	}
+	for (SpillCursor& cursor : tc->cursors) {
+		if (readCursor(tc->client, &cursor)) { tc->mergeHeap.push_back(&cursor); }
+	}
+	std::make_heap(tc->mergeHeap.begin(), tc->mergeHeap.end(), cursorGreater);
+	/* update the number of already processed keys */
+	addProgress(tc->progress->shuffled, total);
+}
+
+/**
+ * @brief orders the readers of the runs in the merge heap, smallest head first.
+ */
+bool cursorGreater(const SpillCursor* c1, const SpillCursor* c2) {
+	return *(c2->head.first) < *(c1->head.first);
+}
+
+/**
+ * @brief moves the cursor to the next pair of its run.
+ * @return false if the run has no more pairs.
+ */
+bool readCursor(const MapReduceClient* client, SpillCursor* cursor) {
+	if (cursor->left == 0) {
+		std::vector<char>().swap(cursor->buffer);
+		return false;
+	}
+	--(cursor->left);
+	if (cursor->fd < 0) {
+		cursor->head = *(cursor->next++);
+		return true;
+	}
+	uint32_t size;
+	fillCursor(cursor, sizeof(size));
+	memcpy(&size, cursor->buffer.data() + cursor->begin, sizeof(size));
+	cursor->begin += sizeof(size);
+	fillCursor(cursor, size);
+	cursor->head = client->deserializePair(cursor->buffer.data() + cursor->begin, size);
+	cursor->begin += size;
+	return true;
+}
+
+/**
+ * @brief reads from the file of the cursor until its buffer holds the given number
+ * 		  of unparsed bytes. pread is used, so the threads may read the runs of one
+ * 		  file at the same time.
+ */
+void fillCursor(SpillCursor* cursor, size_t bytes) {
+	if (cursor->end - cursor->begin >= bytes) { return; }
+	std::vector<char>& buffer = cursor->buffer;
+	memmove(buffer.data(), buffer.data() + cursor->begin, cursor->end - cursor->begin);
+	cursor->end -= cursor->begin;
+	cursor->begin = 0;
+	if (buffer.size() < bytes) { buffer.resize(bytes); }
+	while (cursor->end < bytes) {
+		const size_t wanted = std::min<uint64_t>(buffer.size() - cursor->end, cursor->last - cursor->offset);
+		const ssize_t got = pread(cursor->fd, buffer.data() + cursor->end, wanted, cursor->offset);
+		if (got <= 0) {
+			fprintf(stderr, "system error: error on pread\n");
+			exit(EXIT_FAILURE);
+		}
+		cursor->end += got;
+		cursor->offset += got;
+	}
+}
+
+/**
+ * @brief the reduce phase of a spilling job: merges the runs of the partition of
+ * 		  this thread (k-way merge), and reduces every key as soon as all its pairs
+ * 		  were merged, so only one group is in memory at a time.
+ * @param deadline the thread stops merging at this time, and resumes later.
+ * @return true if the merge is finished, false if the deadline passed first.
+ */
+bool mergeSpilled(ThreadContext* tc, Deadline deadline) {
+	std::vector<SpillCursor*>& heap = tc->mergeHeap;
+	IntermediateVec group;
+	while (!heap.empty()) {
+		if (std::chrono::steady_clock::now() >= deadline) { return false; }
+		do {
+			std::pop_heap(heap.begin(), heap.end(), cursorGreater);
+			SpillCursor* cursor = heap.back();
+			group.push_back(cursor->head);
+			if (readCursor(tc->client, cursor)) {
+				std::push_heap(heap.begin(), heap.end(), cursorGreater);
+			} else {
+				heap.pop_back();
+			}
+		} while (!heap.empty() && !(*(group.front().first) < *(heap.front()->head.first)));
+		tc->client->reduceRange(group.data(), group.data() + group.size(), tc);
+		addProgress(tc->progress->reduced, group.size());
+		group.clear();
+	}
+	tc->cursors.clear();
+	tc->cursors.shrink_to_fit();
+	return true;
+}
+
+/**
+ * @brief plans the reduce phase: the groups are split into tasks, largest first,
+ * 		  and every task is assigned to the least loaded thread so far (LPT), so one
+ * 		  hot key does not dominate. A group of an associative client which is
+ * 		  larger than the share of one thread is split into parts, combined in
+ * 		  parallel and reduced once.
+ */
+void planReduce(JobContext* jc) {
+	const size_t threads = jc->totalThreads;
+	const bool splittable = !jc->records && jc->contexts[0].client->isReduceAssociative() &&
+							jc->contexts[0].client->hasCombiner() && threads > 1;
+	for (const KeyGroup& group : jc->shuffledVec) {
+		if (splittable && group.size >= MIN_SPLIT_PAIRS &&
+			group.size > jc->totalIntermediatePairs / threads) {
+			jc->splitGroups.emplace_back(new SplitGroup());
+			SplitGroup* split = jc->splitGroups.back().get();
+			split->partials.resize(threads);
+			split->remaining = threads;
+			for (size_t part = 0; part < threads; ++part) {
+				const size_t begin = group.size * part / threads;
+				const size_t end = group.size * (part + 1) / threads;
+				jc->reduceTasks.push_back({group.pairs + begin, nullptr, end - begin, split, part});
+			}
+		} else {
+			jc->reduceTasks.push_back({group.pairs, group.records, group.size, nullptr, 0});
+		}
+	}
+
+	std::vector<size_t> order(jc->reduceTasks.size());
+	for (size_t i = 0; i < order.size(); ++i) { order[i] = i; }
+	std::stable_sort(order.begin(), order.end(), [jc](size_t t1, size_t t2) {
+		return jc->reduceTasks[t1].size > jc->reduceTasks[t2].size;
+	});
+
+	// a min heap of (load, thread)
+	std::vector<std::pair<uint64_t, size_t>> loads;
+	for (size_t i = 0; i < threads; ++i) { loads.emplace_back(0, i); }
+	auto greater = std::greater<std::pair<uint64_t, size_t>>();
+	for (size_t task : order) {
+		std::pop_heap(loads.begin(), loads.end(), greater);
+		loads.back().first += jc->reduceTasks[task].size + 1;
+		jc->contexts[loads.back().second].reduceQueue.push_back(task);
+		std::push_heap(loads.begin(), loads.end(), greater);
+	}
+	for (size_t i = 0; i < threads; ++i) {
+		// both ends of a queue are packed into the 32 bit halves of queueRange
+		if (jc->contexts[i].reduceQueue.size() > UINT32_MAX) {
+			fprintf(stderr, "system error: more than 2^32 reduce tasks in one thread\n");
+			exit(EXIT_FAILURE);
+		}
+		jc->contexts[i].queueRange = jc->contexts[i].reduceQueue.size();
+	}
+}
+
+/**
+ * @brief takes a task out of the reduce queue of tc: the owner takes the largest
+ * 		  task from the front, other threads steal the smallest one from the back.
+ * 		  Both ends are in one atomic word, so a task is never taken twice.
+ * @return false if the queue is empty.
+ */
+bool popTask(ThreadContext* tc, size_t* task, bool steal) {
+	uint64_t range = tc->queueRange.load();
+	while (true) {
+		const uint64_t front = range >> 32, back = range & 0xFFFFFFFF;
+		if (front >= back) { return false; }
+		const uint64_t next = steal ? (front << 32) | (back - 1) : ((front + 1) << 32) | back;
+		if (tc->queueRange.compare_exchange_weak(range, next)) {
+			*task = tc->reduceQueue[steal ? back - 1 : front];
+			return true;
+		}
+	}
+}
+
+/**
+ * @brief runs one reduce task. A part of a split group is combined into the
+ * 		  partials of its group, and the last part reduces all the partials.
+ */
+void runReduceTask(ThreadContext* tc, size_t taskIndex) {
+	const ReduceTask& task = tc->jc->reduceTasks[taskIndex];
+	if (task.records != nullptr) {
+		tc->recordGroup.clear();
+		for (size_t i = 0; i < task.size; ++i) { tc->recordGroup.push_back(task.records[i].record); }
+		tc->client->reduceRecords(tc->recordGroup.data(), tc->recordGroup.data() + task.size, tc);
+		addProgress(tc->progress->reduced, task.size);
+		return;
+	}
+	if (task.split == nullptr) {
+		tc->client->reduceRange(task.pairs, task.pairs + task.size, tc);
+		addProgress(tc->progress->reduced, task.size);
+		return;
+	}
+
+	// the combiner emits into the (already shuffled, so empty) thread vectors
+	tc->client->combine(task.pairs, task.pairs + task.size, tc);
+	IntermediateVec& partial = task.split->partials[task.part];
+	partial.swap(tc->intermediateVec);
+	for (auto &bucket : tc->buckets) {
+		partial.insert(partial.end(), bucket.begin(), bucket.end());
+		bucket.clear();
+	}
+	addProgress(tc->progress->reduced, task.size);
+
+	if (--(task.split->remaining) == 0) {
+		IntermediateVec combined;
+		for (auto &p : task.split->partials) { combined.insert(combined.end(), p.begin(), p.end()); }
+		tc->client->reduceRange(combined.data(), combined.data() + combined.size(), tc);
+	}
+}
+
+/**
+ * @brief allocates size bytes out of the arena, at the given alignment (a power of
+ * 		  2). A new block is allocated when the last one is full (a larger one for
+ * 		  a large size).
+ */
+void* arenaAlloc(Arena* arena, size_t size, size_t align) {
+	size_t padding = (align - (size_t) ((uintptr_t) arena->next % align)) % align;
+	if (size + padding > arena->left) {
+		const size_t blockSize = std::max<size_t>(ARENA_BLOCK, size + align);
+		arena->blocks.push_back(new char[blockSize]);
+		arena->next = arena->blocks.back();
+		arena->left = blockSize;
+		padding = (align - (size_t) ((uintptr_t) arena->next % align)) % align;
+	}
+	void* memory = arena->next + padding;
+	arena->next += padding + size;
+	arena->left -= padding + size;
+	return memory;
+}
+
+/**
+ * @brief frees all the blocks of the arena.
+ */
+void arenaFree(Arena* arena) {
+	for (char* block : arena->blocks) { delete[] block; }
+	arena->blocks.clear();
+	arena->next = nullptr;
+	arena->left = 0;
+}
+
+/**
+ * @brief returns the physical socket of the given CPU, or 0 if it is unknown.
+ */
+int cpuSocket(int cpu) {
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+	FILE* file = fopen(path, "r");
+	if (file == nullptr) { return 0; }
+	int socket = 0;
+	if (fscanf(file, "%d", &socket) != 1) { socket = 0; }
+	fclose(file);
+	return socket;
+}
+
+/**
+ * @brief checks that an explicit CPU list is not empty, and that the process is
+ * 		  allowed to run on all its CPUs, so a thread is never pinned to a CPU it
+ * 		  cannot run on. Exits on an invalid list.
+ */
+void checkAffinity(const AffinityPolicy& affinity) {
+	if (affinity.policy != AFFINITY_EXPLICIT) { return; }
+	if (affinity.cpus == nullptr || affinity.cpusCount <= 0) {
+		fprintf(stderr, "system error: explicit affinity with no CPUs\n");
+		exit(EXIT_FAILURE);
+	}
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		fprintf(stderr, "system error: error on sched_getaffinity\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < affinity.cpusCount; ++i) {
+		const int cpu = affinity.cpus[i];
+		if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
+			fprintf(stderr, "system error: explicit affinity with CPU %d, which the process may not run on\n", cpu);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/**
+ * @brief computes the CPU of each worker thread according to the affinity policy
+ * 		  (an explicit CPU list was already checked by checkAffinity).
+ * @return vector of multiThreadLevel CPUs, or an empty vector if the threads
+ * 		   should not be pinned.
+ */
+std::vector<int> affinityCpus(const AffinityPolicy& affinity, int multiThreadLevel) {
+	std::vector<int> cpus;
+	if (affinity.policy == AFFINITY_EXPLICIT) {
+		for (int i = 0; i < multiThreadLevel; ++i) {
+			cpus.push_back(affinity.cpus[i % affinity.cpusCount]);
+		}
+		return cpus;
+	}
+	if (affinity.policy != AFFINITY_COMPACT && affinity.policy != AFFINITY_SCATTER) { return cpus; }
+
+	// the CPUs this process is allowed to run on, grouped by socket
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		fprintf(stderr, "system error: error on sched_getaffinity\n");
+		exit(EXIT_FAILURE);
+	}
+	std::vector<std::pair<int, int>> socketCpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &allowed)) { socketCpus.emplace_back(cpuSocket(cpu), cpu); }
+	}
+	std::sort(socketCpus.begin(), socketCpus.end());
+
+	std::vector<int> order;
+	if (affinity.policy == AFFINITY_COMPACT) {
+		for (auto const &sc : socketCpus) { order.push_back(sc.second); }
+	} else {
+		// take one CPU from each socket in turn
+		std::vector<std::vector<int>> sockets;
+		for (size_t i = 0; i < socketCpus.size(); ++i) {
+			if (i == 0 || socketCpus[i].first != socketCpus[i - 1].first) { sockets.emplace_back(); }
+			sockets.back().push_back(socketCpus[i].second);
+		}
+		for (size_t round = 0; order.size() < socketCpus.size(); ++round) {
+			for (auto const &socket : sockets) {
+				if (round < socket.size()) { order.push_back(socket[round]); }
+			}
+		}
+	}
+	for (int i = 0; !order.empty() && i < multiThreadLevel; ++i) {
+		cpus.push_back(order[i % order.size()]);
+	}
+	return cpus;
+}
+
+/**
+ * @brief chooses the thread which samples the splitters and gathers the shuffled
+ * 		  partitions to be the first thread on the socket which runs most of the
+ * 		  workers, so most of the data it reads is local.
+ */
+int chooseShuffleThread(const std::vector<int>& cpus) {
+	if (cpus.empty()) { return SHUFFLE_T; }
+	std::vector<int> sockets;
+	for (int cpu : cpus) { sockets.push_back(cpuSocket(cpu)); }
+	int best = SHUFFLE_T;
+	long bestCount = 0;
+	for (size_t i = 0; i < sockets.size(); ++i) {
+		long count = std::count(sockets.begin(), sockets.end(), sockets[i]);
+		if (count > bestCount) {
+			best = (int) i;
+			bestCount = count;
+		}
+	}
+	return best;
+}
+
 void lockMutex (pthread_mutex_t *mutex) {
 	if (pthread_mutex_lock(mutex) != 0){
 		fprintf(stderr, "system error: error on pthread_mutex_lock\n");
@@ -190,20 +1498,51 @@ void unlockMutex (pthread_mutex_t *mutex) {
 
 void freeContext(JobContext* jobContext) {
 	if (jobContext != nullptr) {
+		for (size_t i = 0; jobContext->contexts != nullptr && i < jobContext->totalThreads; ++i) {
+			if (jobContext->contexts[i].spillFile != nullptr) { fclose(jobContext->contexts[i].spillFile); }
+			arenaFree(&(jobContext->contexts[i].arena));
+		}
 		delete[] jobContext->threads;
 		jobContext->threads = nullptr;
-		delete[] jobContext->contexts;
+		deleteAligned(jobContext->contexts, jobContext->totalThreads);
 		jobContext->contexts = nullptr;
 		delete jobContext->barrier;
 		jobContext->barrier = nullptr;
+		deleteAligned(jobContext->progress, jobContext->totalThreads);
+		jobContext->progress = nullptr;
 		delete jobContext;
 		jobContext = nullptr;
 	}
 }
 
+/**
+ * @brief allocates count objects which start at cache line boundaries. Before
+ * 		  C++17 new does not align memory beyond the alignment of the basic types,
+ * 		  whatever the alignment of the type is.
+ */
+template <class T>
+T* newAligned(size_t count) {
+	T* objects = LineAllocator<T>().allocate(count);
+	for (size_t i = 0; i < count; ++i) { new (objects + i) T(); }
+	return objects;
+}
+
+/**
+ * @brief destroys and frees objects allocated by newAligned.
+ */
+template <class T>
+void deleteAligned(T* objects, size_t count) {
+	if (objects == nullptr) { return; }
+	for (size_t i = 0; i < count; ++i) { objects[i].~T(); }
+	LineAllocator<T>().deallocate(objects, count);
+}
+
 void destroyMutexes(JobContext* jobContext) {
 	if (pthread_mutex_destroy(&(jobContext->mutex)) != 0 ||
-		pthread_mutex_destroy(&(jobContext->waitJobMutex)) != 0) {
+		pthread_mutex_destroy(&(jobContext->waitJobMutex)) != 0 ||
+		pthread_mutex_destroy(&(jobContext->sourceMutex)) != 0 ||
+		pthread_cond_destroy(&(jobContext->finishedCond)) != 0 ||
+		pthread_cond_destroy(&(jobContext->sealedCond)) != 0) {
 		fprintf(stderr, "system error: error on pthread_mutex_destroy\n");
 		freeContext(jobContext);
 		exit(EXIT_FAILURE);
@@ -218,30 +1557,117 @@ void emit2 (K2* key, V2* value, void* context) {
 	auto tc =  static_cast<ThreadContext*>(context);
 	// I. saves the intermediary element in the context data structures (intermediate vector).
 	IntermediatePair pair(key, value);
-	tc->intermediateVec.push_back(pair);
-	// II. updates the number of intermediary elements using atomic counter.
-	*(tc->counter) += (uint64_t) 1 << 31;
+	if (tc->jc->hashed) {
+		tc->buckets[hashPartition(key->hash(), tc->buckets.size())].push_back(pair);
+	} else {
+		tc->intermediateVec.push_back(pair);
+	}
+	// II. updates the number of intermediary elements using the thread counter.
+	addProgress(tc->progress->emitted, 1);
+	// III. spills the pairs of the thread when it holds too many of them.
+	if (tc->jc->spillThreshold > 0 && !tc->spilling &&
+		tc->intermediateVec.size() >= tc->jc->spillThreshold) {
+		spillPairs(tc);
+	}
+}
+
+void emitRecord (const void* key, size_t keySize, const void* value, size_t valueSize, void* context) {
+	auto tc =  static_cast<ThreadContext*>(context);
+	// the sizes are kept in 32 bits (see IntermediateRecord)
+	if (keySize > UINT32_MAX || valueSize > UINT32_MAX) {
+		fprintf(stderr, "system error: a record key or value of 4GB or more\n");
+		exit(EXIT_FAILURE);
+	}
+	// I. copies the bytes of the record into the arena of the thread.
+	char* bytes = static_cast<char*>(arenaAlloc(&(tc->arena), keySize + valueSize, 1));
+	memcpy(bytes, key, keySize);
+	memcpy(bytes + keySize, value, valueSize);
+	// II. indexes the record, with the prefix of its key.
+	RecordRef ref;
+	ref.prefix = keyPrefix(bytes, keySize);
+	ref.record = {bytes, bytes + keySize, (uint32_t) keySize, (uint32_t) valueSize};
+	tc->records.push_back(ref);
+	// III. updates the number of intermediary elements using the thread counter.
+	addProgress(tc->progress->emitted, 1);
+}
+
+void* mr_alloc (void* context, size_t size) {
+	auto tc =  static_cast<ThreadContext*>(context);
+	return arenaAlloc(&(tc->arena), size, alignof(std::max_align_t));
+}
+
+IntermediateVec* groupVector(void* context) {
+	return &(static_cast<ThreadContext*>(context)->group);
 }
 
 void emit3 (K3* key, V3* value, void* context) {
-	auto tc =  static_cast<ThreadContext*>(context);;
-	lockMutex(tc->mutex);
-	// I. saves the output element in the context data structures (output vector).
-	OutputPair pair(key, value);
-	tc->outputVec->push_back(pair);
+	auto tc =  static_cast<ThreadContext*>(context);
+	// I. saves the output element in the thread output buffer, no lock is needed.
+	tc->outputBuffer.emplace_back(key, value);
+	// a sink gets the output in batches, so it is consumed while the job still reduces
+	if (tc->jc->sinkBatch != SIZE_MAX && (tc->outputBuffer.size() >= tc->jc->sinkBatch ||
+		std::chrono::steady_clock::now() - tc->lastFlush >= std::chrono::nanoseconds(SINK_FLUSH_NS))) {
+		flushOutput(tc);
+	}
 	// II. updates the number of output elements using atomic counter.
 	/** WE UPDATE IT OUTSIDE emit3 **/
-	unlockMutex(tc->mutex);
 }
 
 JobHandle startMapReduceJob(const MapReduceClient& client,
 							const InputVec& inputVec, OutputVec& outputVec,
 							int multiThreadLevel) {
+	AffinityPolicy noAffinity = {AFFINITY_NONE, nullptr, 0};
+	return startMapReduceJob(client, inputVec, outputVec, multiThreadLevel, noAffinity);
+}
+
+JobHandle startMapReduceJob(const MapReduceClient& client,
+							const InputVec& inputVec, OutputVec& outputVec,
+							int multiThreadLevel, const AffinityPolicy& affinity) {
+	return startJob(client, &inputVec, nullptr, &outputVec, nullptr, multiThreadLevel, affinity);
+}
+
+JobHandle startMapReduceJob(const MapReduceClient& client,
+							InputSource& source, OutputVec& outputVec,
+							int multiThreadLevel) {
+	AffinityPolicy noAffinity = {AFFINITY_NONE, nullptr, 0};
+	return startJob(client, nullptr, &source, &outputVec, nullptr, multiThreadLevel, noAffinity);
+}
+
+JobHandle startMapReduceJob(const MapReduceClient& client,
+							const InputVec& inputVec, OutputSink& sink,
+							int multiThreadLevel) {
+	AffinityPolicy noAffinity = {AFFINITY_NONE, nullptr, 0};
+	return startJob(client, &inputVec, nullptr, nullptr, &sink, multiThreadLevel, noAffinity);
+}
+
+JobHandle startMapReduceJob(const MapReduceClient& client,
+							InputSource& source, OutputSink& sink,
+							int multiThreadLevel) {
+	AffinityPolicy noAffinity = {AFFINITY_NONE, nullptr, 0};
+	return startJob(client, nullptr, &source, nullptr, &sink, multiThreadLevel, noAffinity);
+}
+
+/**
+ * @brief starts a job on its own threads, which reads the input vector or the
+ * 		  input source, and writes to the output vector or the output sink (the
+ * 		  other one of each is nullptr).
+ */
+JobHandle startJob(const MapReduceClient& client, const InputVec* inputVec, InputSource* source,
+				   OutputVec* outputVec, OutputSink* sink, int multiThreadLevel,
+				   const AffinityPolicy& affinity) {
+	checkAffinity(affinity);
+
 	// (1) create the job context
 	JobContext* context;
+	std::vector<int> cpus;
 	try {
 		context = new JobContext();
-		initJobContext(context, client, inputVec, outputVec, multiThreadLevel);
+		initJobContext(context, client, inputVec, source, outputVec, sink, multiThreadLevel);
+		context->threads = new pthread_t[multiThreadLevel];
+		context->barrier = new Barrier(multiThreadLevel);
+		for (int i = 0; i < multiThreadLevel; ++i) { context->contexts[i].barrier = context->barrier; }
+		cpus = affinityCpus(affinity, multiThreadLevel);
+		context->shuffleThread = chooseShuffleThread(cpus);
 	} catch (std::bad_alloc& ba) {
 		fprintf(stderr, "system error: error std::bad_alloc\n");
 		destroyMutexes(context);
@@ -249,14 +1675,33 @@ JobHandle startMapReduceJob(const MapReduceClient& client,
 		exit(EXIT_FAILURE);
 	}
 
-	// (2) create the job threads
+	// (2) create the job threads, pinned to their CPUs if required
 	for (int i = 0; i < multiThreadLevel; ++i) {
-		if (pthread_create(context->threads+i, NULL, threadRoutine, context->contexts+i) != 0) {
+		pthread_attr_t attr;
+		if (pthread_attr_init(&attr) != 0) {
+			fprintf(stderr, "system error: error on pthread_attr_init\n");
+			destroyMutexes(context);
+			freeContext(context);
+			exit(EXIT_FAILURE);
+		}
+		if (!cpus.empty()) {
+			cpu_set_t cpuSet;
+			CPU_ZERO(&cpuSet);
+			CPU_SET(cpus[i], &cpuSet);
+			if (pthread_attr_setaffinity_np(&attr, sizeof(cpuSet), &cpuSet) != 0) {
+				fprintf(stderr, "system error: error on pthread_attr_setaffinity_np\n");
+				destroyMutexes(context);
+				freeContext(context);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (pthread_create(context->threads+i, &attr, threadRoutine, context->contexts+i) != 0) {
 			fprintf(stderr, "system error: error on pthread_create\n");
 			destroyMutexes(context);
 			freeContext(context);
 			exit(EXIT_FAILURE);
 		}
+		pthread_attr_destroy(&attr);
 	}
 
 	return context;
@@ -265,7 +1710,15 @@ JobHandle startMapReduceJob(const MapReduceClient& client,
 void waitForJob(JobHandle job) {
 	auto jc = static_cast<JobContext*>(job);
 	pthread_mutex_lock((&jc->waitJobMutex));
-	if (!jc->waiting) {
+	if (jc->executor != nullptr) {
+		// the lanes of the job run on the executor threads, which are not joined
+		while (!jc->finished) {
+			if (pthread_cond_wait(&(jc->finishedCond), &(jc->waitJobMutex)) != 0) {
+				fprintf(stderr, "system error: error on pthread_cond_wait\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	} else if (!jc->waiting) {
 		jc->waiting = true;
 		for (size_t i = 0; i < jc->totalThreads; ++i) {
 			if (pthread_join(jc->threads[i], NULL) != 0) {
@@ -282,29 +1735,40 @@ void waitForJob(JobHandle job) {
 
 void getJobState(JobHandle job, JobState* state) {
 	auto jc =  static_cast<const JobContext*>(job);
-	pthread_mutex_lock(jc->contexts[0].mutex);
-	state->stage = static_cast<stage_t>(jc->counter >> 62);
-	uint processed_keys;
-	uint total_keys;
+	// no lock: the stage is read first, its total was stored before it (see
+	// enterStage), and every counter is an atomic written by its thread only, so
+	// polling never blocks the job, and the job never blocks a poll
+	state->stage = static_cast<stage_t>(jc->stage.load(std::memory_order_acquire));
+	uint64_t processed_keys = 0;
+	uint64_t total_keys;
 	switch (state->stage) {
 		case MAP_STAGE:
-			total_keys = jc->contexts[0].inputVec->size();
-			processed_keys = jc->counter & (0x7FFFFFFF);
-			state->percentage = (processed_keys < total_keys) ?
-								100 * static_cast<float>(processed_keys)/total_keys : 100;
+			total_keys = jc->inputSize;
+			for (size_t i = 0; i < jc->totalThreads; ++i) {
+				processed_keys += jc->progress[i].mapped.load(std::memory_order_relaxed);
+			}
 			break;
 		case SHUFFLE_STAGE:
+			total_keys = jc->totalIntermediatePairs.load(std::memory_order_relaxed);
+			for (size_t i = 0; i < jc->totalThreads; ++i) {
+				processed_keys += jc->progress[i].shuffled.load(std::memory_order_relaxed);
+			}
+			break;
 		case REDUCE_STAGE:
-			total_keys = jc->totalIntermediatePairs;
-			processed_keys = jc->counter>>31 & (0x7FFFFFFF);
-			state->percentage = 100 * static_cast<float>(processed_keys)/total_keys;
-//			state->percentage = (processed_keys < total_keys) ?
-//								100 * static_cast<float>(processed_keys)/total_keys : 100;
+			total_keys = jc->totalIntermediatePairs.load(std::memory_order_relaxed);
+			for (size_t i = 0; i < jc->totalThreads; ++i) {
+				processed_keys += jc->progress[i].reduced.load(std::memory_order_relaxed);
+			}
 			break;
 		default:
-			state->percentage = 0;
+			total_keys = 0;
+	}
+	if (state->stage == UNDEFINED_STAGE || (state->stage == MAP_STAGE && total_keys == 0 && jc->source)) {
+		state->percentage = 0;	// the size of an input source may be unknown until it ends
+	} else {
+		state->percentage = (processed_keys < total_keys) ?
+							100 * static_cast<float>(processed_keys)/total_keys : 100;
 	}
-	pthread_mutex_unlock(jc->contexts[0].mutex);
 }
 
 void closeJobHandle(JobHandle job) {
@@ -314,4 +1778,233 @@ void closeJobHandle(JobHandle job) {
 	auto jc =  static_cast<JobContext*>(job);
 	destroyMutexes(jc);
 	freeContext(jc);
-}
\ No newline at end of file
+}
+
+// ================================================================================== //
+// ============================== EXECUTOR ========================================== //
+// ================================================================================== //
+
+MapReduceExecutor::MapReduceExecutor(int threads) {
+	try {
+		context = new ExecutorContext();
+		context->totalThreads = threads;
+		context->threads = new pthread_t[threads];
+	} catch (std::bad_alloc& ba) {
+		fprintf(stderr, "system error: error std::bad_alloc\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < threads; ++i) {
+		if (pthread_create(context->threads + i, NULL, executorRoutine, context) != 0) {
+			fprintf(stderr, "system error: error on pthread_create\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+MapReduceExecutor::~MapReduceExecutor() {
+	lockMutex(&(context->mutex));
+	context->stopping = true;
+	pthread_cond_broadcast(&(context->workReady));
+	unlockMutex(&(context->mutex));
+	for (size_t i = 0; i < context->totalThreads; ++i) {
+		if (pthread_join(context->threads[i], NULL) != 0) {
+			fprintf(stderr, "system error: could not join executor thread number %zu\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (pthread_mutex_destroy(&(context->mutex)) != 0 ||
+		pthread_cond_destroy(&(context->workReady)) != 0) {
+		fprintf(stderr, "system error: error on pthread_mutex_destroy\n");
+		exit(EXIT_FAILURE);
+	}
+	delete[] context->threads;
+	delete context;
+}
+
+JobHandle MapReduceExecutor::submit(const MapReduceClient& client,
+									const InputVec& inputVec, OutputVec& outputVec,
+									int multiThreadLevel) {
+	JobSchedule schedule = {0, 1};
+	return submit(client, inputVec, outputVec, multiThreadLevel, schedule);
+}
+
+JobHandle MapReduceExecutor::submit(const MapReduceClient& client,
+									const InputVec& inputVec, OutputVec& outputVec,
+									int multiThreadLevel, const JobSchedule& schedule) {
+	return submitJob(context, client, &inputVec, nullptr, &outputVec, nullptr, multiThreadLevel, schedule);
+}
+
+JobHandle MapReduceExecutor::submit(const MapReduceClient& client,
+									InputSource& source, OutputVec& outputVec,
+									int multiThreadLevel, const JobSchedule& schedule) {
+	return submitJob(context, client, nullptr, &source, &outputVec, nullptr, multiThreadLevel, schedule);
+}
+
+JobHandle MapReduceExecutor::submit(const MapReduceClient& client,
+									const InputVec& inputVec, OutputSink& sink,
+									int multiThreadLevel, const JobSchedule& schedule) {
+	return submitJob(context, client, &inputVec, nullptr, nullptr, &sink, multiThreadLevel, schedule);
+}
+
+JobHandle MapReduceExecutor::submit(const MapReduceClient& client,
+									InputSource& source, OutputSink& sink,
+									int multiThreadLevel, const JobSchedule& schedule) {
+	return submitJob(context, client, nullptr, &source, nullptr, &sink, multiThreadLevel, schedule);
+}
+
+/**
+ * @brief queues a job to the executor, which reads the input vector or the input
+ * 		  source, and writes to the output vector or the output sink (the other one
+ * 		  of each is nullptr).
+ */
+JobHandle submitJob(ExecutorContext* context, const MapReduceClient& client, const InputVec* inputVec,
+					InputSource* source, OutputVec* outputVec, OutputSink* sink,
+					int multiThreadLevel, const JobSchedule& schedule) {
+	JobContext* jc;
+	try {
+		jc = new JobContext();
+		jc->executor = context;
+		initJobContext(jc, client, inputVec, source, outputVec, sink, multiThreadLevel);
+	} catch (std::bad_alloc& ba) {
+		fprintf(stderr, "system error: error std::bad_alloc\n");
+		exit(EXIT_FAILURE);
+	}
+	jc->schedule = schedule;
+	if (jc->schedule.weight < 1) { jc->schedule.weight = 1; }
+
+	lockMutex(&(context->mutex));
+	// a new job starts at the virtual time of the executor, so it gets its share
+	// from now on, and does not take the time the older jobs already ran
+	jc->virtualTime = context->virtualTime;
+	context->jobs.push_back(jc);
+	pthread_cond_broadcast(&(context->workReady));
+	unlockMutex(&(context->mutex));
+	return jc;
+}
+
+// ================================================================================== //
+// ============================== CHAIN ============================================= //
+// ================================================================================== //
+
+/**
+ * The link between two stages of a chain: the output sink of a stage, and the
+ * input source of the next one, which run together. Every batch the reducers of
+ * the stage write is kept as a chunk until the mappers of the next stage read
+ * it, and the pairs are converted into input pairs by the client of the next
+ * stage as they are read, so a pair is held once, as an output pair before it
+ * is read and as an input pair after. The pairs are deleted with the buffer,
+ * once the next stage finished: deleting them as soon as they are mapped would
+ * scatter the pairs which the next stage allocates over the freed memory, which
+ * makes its sort much slower.
+ */
+class ChainBuffer : public OutputSink, public InputSource {
+public:
+	explicit ChainBuffer(const MapReduceClient* next) : next(next) { }
+
+	~ChainBuffer() {
+		for (InputPair& pair : mapped) {
+			delete pair.first;
+			delete pair.second;
+		}
+		// the pairs which were not read, if the next stage did not run
+		for (size_t c = 0; c < chunks.size(); ++c) {
+			for (size_t i = (c == 0) ? offset : 0; i < chunks[c].size(); ++i) {
+				delete chunks[c][i].first;
+				delete chunks[c][i].second;
+			}
+		}
+		pthread_mutex_destroy(&mutex);
+	}
+
+	void write(const OutputPair* pairs, size_t count) {
+		lockMutex(&mutex);
+		chunks.emplace_back(pairs, pairs + count);
+		unlockMutex(&mutex);
+		written += count;
+	}
+
+	/**
+	 * @brief called once the stage finished, so the next one reads the end of
+	 * 		  the input after the last chunk.
+	 */
+	void close() { closed = true; }
+
+	size_t read(InputPair* pairs, size_t max) {
+		size_t count = 0;
+		lockMutex(&mutex);
+		while (count < max && !chunks.empty()) {
+			const OutputVec& chunk = chunks.front();
+			const size_t n = std::min(max - count, chunk.size() - offset);
+			for (size_t i = 0; i < n; ++i) {
+				pairs[count++] = next->chainInput(chunk[offset + i].first, chunk[offset + i].second);
+			}
+			offset += n;
+			if (offset == chunk.size()) {
+				chunks.pop_front();
+				offset = 0;
+			}
+		}
+		unlockMutex(&mutex);
+		consumed += count;
+		return count;
+	}
+
+	void release(InputPair* pairs, size_t count) {
+		lockMutex(&mutex);
+		mapped.insert(mapped.end(), pairs, pairs + count);
+		unlockMutex(&mutex);
+	}
+
+	bool ready() const { return closed || consumed < written; }
+
+private:
+	const MapReduceClient* next;
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	std::deque<OutputVec> chunks;	// the batches which were not read yet, oldest first
+	size_t offset = 0;	// the pairs of the first chunk which were read
+	std::atomic<size_t> written{0};
+	std::atomic<size_t> consumed{0};	// written only by reads, which are serialized
+	std::atomic<bool> closed{false};
+	std::vector<InputPair> mapped;	// the input pairs which were read
+};
+
+MapReduceChain::MapReduceChain(MapReduceExecutor& executor) : executor(&executor) { }
+
+void MapReduceChain::addStage(const MapReduceClient& client, int multiThreadLevel) {
+	clients.push_back(&client);
+	levels.push_back(multiThreadLevel);
+}
+
+void MapReduceChain::run(const InputVec& inputVec, OutputVec& outputVec) {
+	VectorSink sink(&outputVec);
+	run(inputVec, sink);
+}
+
+void MapReduceChain::run(const InputVec& inputVec, OutputSink& sink) {
+	if (clients.empty()) {
+		fprintf(stderr, "system error: run of a chain with no stages\n");
+		exit(EXIT_FAILURE);
+	}
+	const JobSchedule schedule = {0, 1};
+	// buffers[i] links stage i to stage i + 1
+	std::vector<std::unique_ptr<ChainBuffer>> buffers(clients.size() - 1);
+	std::vector<JobHandle> jobs(clients.size());
+	try {
+		for (size_t i = 0; i + 1 < clients.size(); ++i) { buffers[i].reset(new ChainBuffer(clients[i + 1])); }
+	} catch (std::bad_alloc& ba) {
+		fprintf(stderr, "system error: error std::bad_alloc\n");
+		exit(EXIT_FAILURE);
+	}
+	// all the stages are submitted at once, and a stage maps while the previous one reduces
+	for (size_t i = 0; i < clients.size(); ++i) {
+		OutputSink& stageSink = (i + 1 < clients.size()) ? *(buffers[i]) : sink;
+		jobs[i] = (i == 0) ?
+				  executor->submit(*(clients[i]), inputVec, stageSink, levels[i], schedule) :
+				  executor->submit(*(clients[i]), *(buffers[i - 1]), stageSink, levels[i], schedule);
+	}
+	for (size_t i = 0; i < clients.size(); ++i) {
+		closeJobHandle(jobs[i]);
+		if (i + 1 < clients.size()) { buffers[i]->close(); }
+		if (i > 0) { buffers[i - 1].reset(); }
+	}
+}
@@ -1,6 +1,8 @@
 #ifndef MAPREDUCEFRAMEWORK_H
 #define MAPREDUCEFRAMEWORK_H
 
+#include <new>
+#include <utility>
 #include "MapReduceClient.h"
 
 /**
@@ -20,10 +22,103 @@ typedef struct {
 	float percentage;
 } JobState;
 
+/**
+ * @brief the CPU affinity policies of the worker threads of a job:
+ * 		  NONE - the threads are not pinned, the kernel may migrate them freely.
+ * 		  COMPACT - the threads are pinned to consecutive CPUs, filling a socket
+ * 		  			before moving to the next one.
+ * 		  SCATTER - the threads are pinned round-robin over the sockets.
+ * 		  EXPLICIT - thread i is pinned to cpus[i % cpusCount]. The list must not be
+ * 		  			 empty, and the process must be allowed to run on all its CPUs
+ * 		  			 (see sched_getaffinity), else the process exits when the job starts.
+ */
+enum affinity_t {AFFINITY_NONE=0, AFFINITY_COMPACT=1, AFFINITY_SCATTER=2, AFFINITY_EXPLICIT=3};
+
+/**
+ * @brief a struct which describes how the worker threads of a job are pinned.
+ */
+typedef struct {
+	affinity_t policy;
+	const int* cpus;
+	int cpusCount;
+} AffinityPolicy;
+
+/**
+ * @brief a source of input pairs, which a job reads while it runs instead of an
+ * 		  InputVec which holds the whole input (e.g. the lines of a large file, or
+ * 		  records made by a generator). The mapping threads read chunks of pairs as
+ * 		  they need them, so mapping starts before the input is loaded, and only the
+ * 		  chunks being mapped are in memory.
+ */
+class InputSource {
+public:
+	virtual ~InputSource() {}
+
+	/**
+	 * @brief reads up to max next input pairs into pairs. The calls are serialized
+	 * 		  by the framework.
+	 * @return the number of pairs read, 0 once the input ended (and on every call after).
+	 */
+	virtual size_t read(InputPair* pairs, size_t max) = 0;
+
+	/**
+	 * @brief called once the pairs of a read were mapped, so the source may free them.
+	 * 		  May be called from several threads at once.
+	 */
+	virtual void release(InputPair* pairs, size_t count) { }
+
+	/**
+	 * @brief whether read would return pairs, or the end of the input, right now. A
+	 * 		  source which is filled while the job runs (e.g. by another job) returns
+	 * 		  false while it has no pairs: the lanes of a job on an executor do not map
+	 * 		  until it is ready, and leave the executor threads to the other jobs, and
+	 * 		  the threads of a job of its own yield. It is called often, and from the
+	 * 		  executor threads, so it should be cheap and not block.
+	 */
+	virtual bool ready() const { return true; }
+
+	/**
+	 * @brief the number of input pairs if it is known, for the progress of the map
+	 * 		  stage in getJobState, 0 otherwise (the map stage then shows 0%).
+	 */
+	virtual size_t sizeHint() const { return 0; }
+};
+
+/**
+ * @brief a consumer of output pairs, which gets the output of a job while it runs
+ * 		  instead of an OutputVec which is filled when the job ends (e.g. to write
+ * 		  the output to a file, or to feed it to another job). Every reducing thread
+ * 		  buffers its output pairs, and writes them to the sink in batches, at least
+ * 		  every millisecond, and when it finishes reducing.
+ */
+class OutputSink {
+public:
+	virtual ~OutputSink() {}
+
+	/**
+	 * @brief consumes a batch of output pairs, which the sink owns from now on. The
+	 * 		  calls are serialized by the framework.
+	 */
+	virtual void write(const OutputPair* pairs, size_t count) = 0;
+};
+
+/**
+ * @brief a struct which describes how a job submitted to a MapReduceExecutor shares
+ * 		  the executor threads with the other jobs:
+ * 		  priority - the lanes of a job run only when no job of a higher priority
+ * 		  			 has a lane which can run.
+ * 		  weight - jobs of the same priority get the executor threads in proportion
+ * 		  		   to their weights (greater or equal to 1).
+ */
+typedef struct {
+	int priority;
+	int weight;
+} JobSchedule;
+
 /**
  * @brief This function saves the intermediary element (K2*, V2*) in the context
  * 	      data structures (intermediate vector).
- * 	   &  updates the number of intermediary elements using atomic counter.
+ * 	   &  updates the number of intermediary elements in the progress counters of the thread.
  * @param key key of intermediary element.
  * @param value value of intermediary element.
  * @param context contains data structure (intermediate vector) of the thread that
@@ -31,9 +126,25 @@ typedef struct {
  */
 void emit2 (K2* key, V2* value, void* context);
 
+/**
+ * @brief This function saves a flat intermediary record, a copy of the given key and
+ * 		  value bytes, in the context data structures (the record memory of the thread).
+ * 		  Used instead of emit2 by clients whose usesRecords returns true. The records
+ * 		  are grouped and ordered by the bytes of their keys.
+ * @param key the bytes of the key of the record.
+ * @param value the bytes of the value of the record.
+ * 		  The key and the value should be smaller than 4GB each, the process exits
+ * 		  on a larger one.
+ * @param context contains data structure (record memory) of the thread that
+ * 	      created the record.
+ */
+void emitRecord (const void* key, size_t keySize, const void* value, size_t valueSize, void* context);
+
 /**
  * @brief This function saves the output element (K3*, V3*) in the context
- * 	      data structures (output vector).
+ * 	      data structures (the output buffer of the thread, which is added to the
+ * 	      output vector once the thread finishes reducing, or written to the output
+ * 	      sink in batches).
  * 	   &  updates the number of output elements using atomic counter.
  * @param key key of output element.
  * @param value value of output element.
@@ -42,6 +153,28 @@ void emit2 (K2* key, V2* value, void* context);
  */
 void emit3 (K3* key, V3* value, void* context);
 
+/**
+ * @brief This function allocates memory out of the arena of the calling thread, for
+ * 		  keys and values which the client creates in map, combine or reduce. There
+ * 		  is no lock and no call to the global allocator for most allocations: the
+ * 		  arena takes large blocks, and all of them are freed together by
+ * 		  closeJobHandle. The memory must not be freed (or deleted) by the client,
+ * 		  and is not valid after the job is closed, so output pairs should not use it.
+ * @param size the number of bytes, the memory is aligned like any type.
+ * @param context the context given to map, combine or reduce.
+ * @return a pointer to the memory.
+ */
+void* mr_alloc (void* context, size_t size);
+
+/**
+ * @brief constructs an object in memory of mr_alloc (e.g. mr_new<KChar>(context, c)).
+ * 		  Its destructor is never called, so it should own no other resources.
+ */
+template <class T, class... Args>
+T* mr_new (void* context, Args&&... args) {
+	return new (mr_alloc(context, sizeof(T))) T(std::forward<Args>(args)...);
+}
+
 /**
  * @brief This function starts running the MapReduce algorithm (with several threads)
  * 		  and returns a JobHandle.
@@ -60,6 +193,46 @@ JobHandle startMapReduceJob(const MapReduceClient& client,
 	const InputVec& inputVec, OutputVec& outputVec,
 	int multiThreadLevel);
 
+/**
+ * @brief Same as startMapReduceJob above, but pins each worker thread at its creation
+ * 		  according to the given affinity policy. The thread which coordinates the shuffle
+ * 		  is chosen on the socket which holds most of the workers, to minimize cross-socket
+ * 		  reads of the intermediate vectors.
+ * @param affinity the affinity policy of the worker threads.
+ * @return The function returns JobHandle that will be used for monitoring the job.
+ */
+JobHandle startMapReduceJob(const MapReduceClient& client,
+	const InputVec& inputVec, OutputVec& outputVec,
+	int multiThreadLevel, const AffinityPolicy& affinity);
+
+/**
+ * @brief Same as startMapReduceJob above, but the input pairs are read from the given
+ * 		  source while the job runs. The source should stay valid until the job is
+ * 		  finished.
+ * @return The function returns JobHandle that will be used for monitoring the job.
+ */
+JobHandle startMapReduceJob(const MapReduceClient& client,
+	InputSource& source, OutputVec& outputVec,
+	int multiThreadLevel);
+
+/**
+ * @brief Same as startMapReduceJob above, but the output pairs are written to the
+ * 		  given sink while the job runs. The sink should stay valid until the job is
+ * 		  finished.
+ * @return The function returns JobHandle that will be used for monitoring the job.
+ */
+JobHandle startMapReduceJob(const MapReduceClient& client,
+	const InputVec& inputVec, OutputSink& sink,
+	int multiThreadLevel);
+
+/**
+ * @brief Same as startMapReduceJob above, with an input source and an output sink.
+ * @return The function returns JobHandle that will be used for monitoring the job.
+ */
+JobHandle startMapReduceJob(const MapReduceClient& client,
+	InputSource& source, OutputSink& sink,
+	int multiThreadLevel);
+
 /**
  * @brief a function gets JobHandle returned by startMapReduceFramework
  * 		  and waits until it is finished
@@ -70,7 +243,11 @@ void waitForJob(JobHandle job);
 
 /**
  * @brief this function gets a JobHandle and updates the state of the job
- * 	      into the given JobState struct.
+ * 	      into the given JobState struct. It takes no lock, so it may be called
+ * 	      from any thread, as often as needed, without slowing the job down.
+ * 	      A pipelined job (see MapReduceClient::pipelined) is in the shuffle stage
+ * 	      while its partitions are sealed, grouped and reduced, and in the reduce
+ * 	      stage once all of them were sealed.
  * @param job JobHandle
  * @param state JobState
  */
@@ -84,6 +261,119 @@ void getJobState(JobHandle job, JobState* state);
  */
 void closeJobHandle(JobHandle job);
 
+/**
+ * @brief a pool of worker threads which runs MapReduce jobs. The threads are created
+ * 		  once, so submitting a job creates no threads: each job is split into
+ * 		  multiThreadLevel lanes, which the pool threads run in quanta of a few
+ * 		  milliseconds, and the lanes of several jobs share the pool according to
+ * 		  their JobSchedule.
+ * 		  The handle returned by submit is used with waitForJob, getJobState and
+ * 		  closeJobHandle, like the handle returned by startMapReduceJob.
+ */
+class MapReduceExecutor {
+public:
+	/**
+	 * @brief creates the pool threads.
+	 * @param threads the number of pool threads (greater or equal to 1).
+	 */
+	explicit MapReduceExecutor(int threads);
+
+	/**
+	 * @brief waits until all the submitted jobs are finished, and joins the pool threads.
+	 * 		  The handles of the jobs should still be closed with closeJobHandle.
+	 */
+	~MapReduceExecutor();
+
+	/**
+	 * @brief queues a job to the pool, with the same arguments as startMapReduceJob.
+	 * @param multiThreadLevel the number of lanes of the job, the most pool threads
+	 * 		  which work on the job at once.
+	 * @return The function returns JobHandle that will be used for monitoring the job.
+	 */
+	JobHandle submit(const MapReduceClient& client,
+		const InputVec& inputVec, OutputVec& outputVec,
+		int multiThreadLevel);
+
+	/**
+	 * @brief Same as submit above, with the given priority and weight (the default
+	 * 		  is priority 0 and weight 1).
+	 */
+	JobHandle submit(const MapReduceClient& client,
+		const InputVec& inputVec, OutputVec& outputVec,
+		int multiThreadLevel, const JobSchedule& schedule);
+
+	/**
+	 * @brief Same as submit above, with the input pairs read from the given source.
+	 */
+	JobHandle submit(const MapReduceClient& client,
+		InputSource& source, OutputVec& outputVec,
+		int multiThreadLevel, const JobSchedule& schedule);
+
+	/**
+	 * @brief Same as submit above, with the output pairs written to the given sink.
+	 */
+	JobHandle submit(const MapReduceClient& client,
+		const InputVec& inputVec, OutputSink& sink,
+		int multiThreadLevel, const JobSchedule& schedule);
+
+	/**
+	 * @brief Same as submit above, with an input source and an output sink.
+	 */
+	JobHandle submit(const MapReduceClient& client,
+		InputSource& source, OutputSink& sink,
+		int multiThreadLevel, const JobSchedule& schedule);
+
+private:
+	MapReduceExecutor(const MapReduceExecutor&);
+	MapReduceExecutor& operator=(const MapReduceExecutor&);
+
+	struct ExecutorContext* context;
+};
+
+/**
+ * @brief a chain of MapReduce stages, for iterative algorithms (e.g. PageRank or
+ * 		  k-means rounds) and multi-step jobs: the output pairs of every stage are
+ * 		  the input pairs of the next one. The stages run together on a shared
+ * 		  MapReduceExecutor, so no thread is created for a stage, and every batch
+ * 		  of output pairs goes straight from the reducers of a stage to the mappers
+ * 		  of the next one (see MapReduceClient::chainInput), which map it while the
+ * 		  stage still reduces, with no OutputVec to copy into a new InputVec. The
+ * 		  output pairs of a stage are deleted by the chain once the next stage
+ * 		  finished.
+ */
+class MapReduceChain {
+public:
+	/**
+	 * @brief creates an empty chain, whose stages run on the given executor.
+	 */
+	explicit MapReduceChain(MapReduceExecutor& executor);
+
+	/**
+	 * @brief adds a stage after the last one. The client should stay valid until the
+	 * 		  chain is destroyed.
+	 * @param multiThreadLevel the number of lanes of the stage on the executor.
+	 */
+	void addStage(const MapReduceClient& client, int multiThreadLevel);
+
+	/**
+	 * @brief runs all the stages (at least one, the process exits on a chain with
+	 * 		  no stages) on the input, and returns once the output pairs of the last
+	 * 		  stage were added to outputVec.
+	 */
+	void run(const InputVec& inputVec, OutputVec& outputVec);
+
+	/**
+	 * @brief Same as run above, with the output pairs of the last stage written to
+	 * 		  the given sink.
+	 */
+	void run(const InputVec& inputVec, OutputSink& sink);
+
+private:
+	MapReduceExecutor* executor;
+	std::vector<const MapReduceClient*> clients;
+	std::vector<int> levels;
+};
+
 	
 	
 #endif //MAPREDUCEFRAMEWORK_H
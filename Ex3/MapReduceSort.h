@@ -0,0 +1,113 @@
+#ifndef MAPREDUCESORT_H
+#define MAPREDUCESORT_H
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+// the sort and merge helpers of the shuffle, shared by the framework and by the
+// typed front end (MapReduce.h). Item is the sorted type (a pair, or a record),
+// and less orders items by their keys.
+
+/**
+ * @brief chooses parts-1 splitters out of evenly spaced samples of the (already
+ * 		  sorted) vectors, about samples of each vector, so every part gets about
+ * 		  the same number of items. Equal keys always fall in the same part.
+ */
+template <class Item, class Less>
+void sampleSplitters(const std::vector<const std::vector<Item>*>& sorted, size_t parts, size_t samples,
+					 Less less, std::vector<Item>& splitters) {
+	std::vector<Item> sampled;
+	for (auto vec : sorted) {
+		const size_t step = std::max<size_t>(1, vec->size() / samples);
+		for (size_t j = step / 2; j < vec->size(); j += step) { sampled.push_back((*vec)[j]); }
+	}
+	std::sort(sampled.begin(), sampled.end(), less);
+
+	splitters.clear();
+	for (size_t i = 1; i < parts && !sampled.empty(); ++i) {
+		splitters.push_back(sampled[i * sampled.size() / parts]);
+	}
+}
+
+/**
+ * @brief finds the range of part id, [splitters[id-1], splitters[id]), in a sorted
+ * 		  vector.
+ * @return the indexes of the first item of the range, and of the item after it.
+ */
+template <class Item, class Less>
+std::pair<size_t, size_t> partRange(const std::vector<Item>& vec, const std::vector<Item>& splitters,
+									size_t id, Less less) {
+	auto begin = vec.begin(), end = vec.end();
+	if (id > 0 && id - 1 < splitters.size()) {
+		begin = std::lower_bound(vec.begin(), vec.end(), splitters[id - 1], less);
+	}
+	if (id < splitters.size()) {
+		end = std::lower_bound(vec.begin(), vec.end(), splitters[id], less);
+	} else if (id > splitters.size()) {
+		end = begin;	// fewer splitters than parts, nothing left for this part
+	}
+	return std::make_pair(begin - vec.begin(), end - vec.begin());
+}
+
+/**
+ * @brief merges sorted runs of items (k-way merge) into merged, using a heap of
+ * 		  the runs ordered by their first item. The items are moved if the runs
+ * 		  are of move iterators.
+ */
+template <class Iterator, class Item, class Less>
+void mergeRuns(std::vector<std::pair<Iterator, Iterator>> runs, Less less, std::vector<Item>& merged) {
+	typedef std::pair<Iterator, Iterator> Run;
+	size_t total = 0;
+	runs.erase(std::remove_if(runs.begin(), runs.end(), [](const Run& run) { return !(run.first < run.second); }),
+			   runs.end());
+	for (const Run& run : runs) { total += run.second - run.first; }
+
+	merged.reserve(merged.size() + total);
+	auto runGreater = [less](const Run& r1, const Run& r2) { return less(*(r2.first), *(r1.first)); };
+	std::make_heap(runs.begin(), runs.end(), runGreater);
+	while (!runs.empty()) {
+		std::pop_heap(runs.begin(), runs.end(), runGreater);
+		Run& run = runs.back();
+		merged.push_back(*(run.first));
+		if (++run.first == run.second) {
+			runs.pop_back();
+		} else {
+			std::push_heap(runs.begin(), runs.end(), runGreater);
+		}
+	}
+}
+
+/**
+ * @brief merges the range of part id, [splitters[id-1], splitters[id]), out of
+ * 		  every sorted vector into merged.
+ */
+template <class Item, class Less>
+void mergeRange(const std::vector<const std::vector<Item>*>& sorted, const std::vector<Item>& splitters,
+				size_t id, Less less, std::vector<Item>& merged) {
+	typedef typename std::vector<Item>::const_iterator Iterator;
+	std::vector<std::pair<Iterator, Iterator>> runs;
+	for (auto vec : sorted) {
+		const std::pair<size_t, size_t> range = partRange(*vec, splitters, id, less);
+		runs.emplace_back(vec->begin() + range.first, vec->begin() + range.second);
+	}
+	mergeRuns(runs, less, merged);
+}
+
+/**
+ * @brief calls group(first, last) for every span [first, last) of items with equal
+ * 		  keys in a sorted vector, in order.
+ */
+template <class Item, class Less, class Group>
+void forEachGroup(const std::vector<Item>& sorted, Less less, Group group) {
+	size_t first = 0;
+	while (first < sorted.size()) {
+		size_t last = first + 1;
+		while (last < sorted.size() && !less(sorted[first], sorted[last])) { ++last; }
+		group(first, last);
+		first = last;
+	}
+}
+
+#endif //MAPREDUCESORT_H